@@ -12,6 +12,14 @@
 #include <errno.h>
 #include <math.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <jxl/decode.h>
 #include <jxl/encode.h>
@@ -21,9 +29,19 @@
 #include <lcms2.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMLIB2JXL_SIMD_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define IMLIB2JXL_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 // If your distribution doesn't provide this header with its imlib2 package,
 // it's available at https://git.enlightenment.org/old/legacy-imlib2/src/branch/master/src/lib/Imlib2_Loader.h
+#ifndef IMLIB2JXL_POOL_ONLY
 #include "Imlib2_Loader.h"
+#endif
 
 #if JPEGXL_NUMERIC_VERSION < JPEGXL_COMPUTE_NUMERIC_VERSION(0,9,0)
 #define IMLIB2_JXL_GET_ENCODED_PROFILE(dec, target, color_encoding) JxlDecoderGetColorAsEncodedProfile((dec), NULL, (target), (color_encoding))
@@ -94,238 +112,4603 @@ static void myprintf(FILE *to, const char *file, const char *func, unsigned line
 }
 
 
+#ifndef IMLIB2JXL_POOL_ONLY
 static const char* const formats[] = { "jxl" };
+#endif
 
 
+/**
+ * FNV-1a, 64-bit.
+ */
+static inline uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for(size_t i=0; i<size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ull
 
 
-#ifdef IMLIB2JXL_USE_LCMS
+/**
+ * Counters describing how well the loader's caches are working.
+ * If IMLIB2_JXL_STATS is set in the environment, they're printed to stderr when the loader is unloaded.
+ */
+static struct
+{
+    atomic_uint_fast64_t transform_cache_hits;
+    atomic_uint_fast64_t transform_cache_misses;
+    atomic_uint_fast64_t frame_index_hits;
+    atomic_uint_fast64_t frame_index_misses;
+    atomic_uint_fast64_t prefetch_frames;
+    atomic_uint_fast64_t prefetch_underruns;
+    atomic_uint_fast64_t passthrough_saves;
+    atomic_uint_fast64_t pool_jobs;           ///< Pieces of parallel work run on the shared threads
+    atomic_uint_fast64_t pool_unhelped_jobs;  ///< Jobs that finished before any worker was free to help
+    atomic_uint_fast64_t pool_queue_us;       ///< Total time jobs waited for their first worker
+    atomic_uint_fast64_t pool_queue_max_us;   ///< Longest time a job waited for its first worker
+    atomic_uint_fast64_t mem_pool_hits;       ///< Large allocations served from the memory pool
+    atomic_uint_fast64_t mem_pool_misses;     ///< Large allocations that needed a new block
+    atomic_uint_fast64_t mem_tracked;         ///< Loads and saves whose memory use was recorded
+    atomic_uint_fast64_t mem_peak_total;      ///< Sum of their peak libjxl memory use
+    atomic_uint_fast64_t mem_peak_max;        ///< Highest peak libjxl memory use of any of them
+} loader_stats;
 
+#define STATS_INC(counter) atomic_fetch_add_explicit(&loader_stats.counter, 1, memory_order_relaxed)
+#define STATS_GET(counter) ((uint64_t)atomic_load_explicit(&loader_stats.counter, memory_order_relaxed))
+#define STATS_ADD(counter, n) atomic_fetch_add_explicit(&loader_stats.counter, (n), memory_order_relaxed)
+#define STATS_MAX(counter, n) stats_max(&loader_stats.counter, (n))
 
-#ifdef IMLIB2JXL_DEBUG
 /**
- * @brief Get readable description of ICC profile.
+ * @brief Raise @p counter to @p value if it's lower.
+ */
+static void stats_max(atomic_uint_fast64_t *counter, uint64_t value)
+{
+    uint_fast64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    while(value > current &&
+          !atomic_compare_exchange_weak_explicit(counter, &current, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+__attribute__((destructor))
+static void loader_stats_report(void)
+{
+    if(!getenv("IMLIB2_JXL_STATS"))
+        return;
+
+    fprintf(stderr, "imlib2-jxl stats: transform_cache_hits=%" PRIu64 " transform_cache_misses=%" PRIu64
+            " frame_index_hits=%" PRIu64 " frame_index_misses=%" PRIu64
+            " prefetch_frames=%" PRIu64 " prefetch_underruns=%" PRIu64 " passthrough_saves=%" PRIu64
+            " pool_jobs=%" PRIu64 " pool_unhelped_jobs=%" PRIu64 " pool_queue_us=%" PRIu64 " pool_queue_max_us=%" PRIu64
+            " mem_pool_hits=%" PRIu64 " mem_pool_misses=%" PRIu64 " mem_tracked=%" PRIu64
+            " mem_peak_total=%" PRIu64 " mem_peak_max=%" PRIu64 "\n",
+            STATS_GET(transform_cache_hits), STATS_GET(transform_cache_misses),
+            STATS_GET(frame_index_hits), STATS_GET(frame_index_misses),
+            STATS_GET(prefetch_frames), STATS_GET(prefetch_underruns), STATS_GET(passthrough_saves),
+            STATS_GET(pool_jobs), STATS_GET(pool_unhelped_jobs), STATS_GET(pool_queue_us), STATS_GET(pool_queue_max_us),
+            STATS_GET(mem_pool_hits), STATS_GET(mem_pool_misses), STATS_GET(mem_tracked),
+            STATS_GET(mem_peak_total), STATS_GET(mem_peak_max));
+}
+
+
+
+
+/* Shared worker threads
  *
- * The caller is responsible for freeing the returned pointer.
+ * All loads and saves run their parallel work on one process-wide set of worker threads, so the
+ * total number of threads stays within a budget however many calls are in flight.  Each call's
+ * work is a job: the calling thread works on its own job, and idle workers join whichever job has
+ * the fewest helpers, so concurrent jobs get an equal share of the budget.  Workers move between
+ * jobs whenever one starts or finishes.
  *
- * @return Pointer to allocated string, or @c NULL on failure.
+ * Workers with no job to help with run tasks: background work that nobody is waiting on the
+ * result of straight away, such as decoding animation frames ahead of playback.
+ *
+ * jxl-calibrate includes this file with IMLIB2JXL_POOL_ONLY defined, which leaves out everything
+ * from the tasks on, so that it times decoding with the same pool and runner as the loader.
  */
-static char *get_icc_description(cmsHPROFILE icc)
+
+/**
+ * Upper limit on the thread budget.
+ */
+#define THREAD_BUDGET_MAX 256
+
+/**
+ * Work submitted by one call of pool_run().
+ */
+typedef struct pool_job
 {
-    if(LCMS_VERSION != cmsGetEncodedCMMversion())
-        WARN_PRINTF("Warning: jxl loader was compiled against a different version of liblcms!");
+    struct pool_job *next;
+    void *jpegxl_opaque;
+    JxlParallelRunFunction func;
+    atomic_uint_fast32_t next_value;  ///< Next value of the range to hand out
+    uint32_t end;                     ///< End of the range
+    const atomic_bool *cancelled;     ///< Stop handing out the range when set
+    unsigned max_helpers;             ///< Maximum number of workers that may help at once
+    unsigned helpers;                 ///< Number of workers currently helping
+    uint64_t ids_in_use[(THREAD_BUDGET_MAX + 1 + 63) / 64];  ///< Thread ids taken; id 0 is the caller's
+    uint64_t submitted;               ///< When the job was submitted (ns)
+    uint64_t first_helped;            ///< When the first worker joined (ns), or 0
+} pool_job;
 
-    char *retval = NULL;
-    const char *lang = "en";
-    const char *country = "US";
+/**
+ * A piece of background work, as submitted by pool_task_submit().
+ */
+typedef struct pool_task
+{
+    struct pool_task *next;
+    void (*func)(void *arg);
+    void *arg;
+} pool_task;
+
+/**
+ * Process-wide worker threads.  Everything but @c generation is protected by @c lock.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;         ///< Signalled when a job or task is submitted, or on shutdown
+    pthread_cond_t helper_done;  ///< Signalled when the last helper leaves a job
+    pthread_once_t once;
+    unsigned budget;             ///< Maximum number of worker threads
+    unsigned num_workers;        ///< Number of worker threads started
+    unsigned num_idle;           ///< Number of workers waiting for a job
+    unsigned groups_per_thread;  ///< Minimum number of groups of an image to give each thread
+    pthread_t workers[THREAD_BUDGET_MAX];
+    pool_job *jobs;              ///< Jobs in progress
+    pool_task *tasks;            ///< Tasks waiting for a worker, oldest first
+    atomic_uint generation;      ///< Changes whenever a job starts or finishes, so workers rebalance
+    bool shutdown;
+} thread_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .helper_done = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+/**
+ * Side of the square groups that libjxl divides images into (by default), and which it hands out
+ * to threads.
+ */
+#define GROUP_DIM 256
+
+/**
+ * Default for the minimum number of groups worth giving each thread.  Below this, handing work to
+ * another thread costs more than it saves.  That point hasn't been measured in general, so by default
+ * only single-group images are kept to the calling thread, as libjxl's own runner would share out
+ * anything bigger.  jxl-calibrate measures the right value for a particular machine.
+ */
+#define DEFAULT_GROUPS_PER_THREAD 1
+
+/**
+ * Per-call handle for the thread pool, as returned by runner_acquire().
+ */
+typedef struct
+{
+    unsigned max_helpers;  ///< Maximum number of workers that may help this call
+    atomic_bool cancelled; ///< Set by runner_cancel()
+} pool_runner;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void thread_pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&thread_pool.lock);
+}
+
+static void thread_pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+/**
+ * The child of a fork has none of the workers, and none of the other threads whose jobs might be
+ * listed, so start again from nothing.
+ */
+static void thread_pool_atfork_child(void)
+{
+    thread_pool.num_workers = thread_pool.num_idle = 0;
+    thread_pool.jobs = NULL;
+    thread_pool.tasks = NULL;
+    pthread_cond_init(&thread_pool.work, NULL);
+    pthread_cond_init(&thread_pool.helper_done, NULL);
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+/**
+ * Work out the thread budget from IMLIB2_JXL_THREADS, defaulting to one thread per CPU.
+ */
+static void thread_pool_init(void)
+{
+    const char *env = getenv("IMLIB2_JXL_THREADS");
+    const unsigned long budget = (env && *env) ? strtoul(env, NULL, 10) : JxlThreadParallelRunnerDefaultNumWorkerThreads();
+    thread_pool.budget = (budget > THREAD_BUDGET_MAX) ? THREAD_BUDGET_MAX : budget;
+
+    thread_pool.groups_per_thread = DEFAULT_GROUPS_PER_THREAD;
+    if((env = getenv("IMLIB2_JXL_GROUPS_PER_THREAD")) && strtoul(env, NULL, 10) > 0)
+        thread_pool.groups_per_thread = strtoul(env, NULL, 10);
+
+    DEBUG_PRINTF("Thread budget: %u, at least %u groups per thread", thread_pool.budget, thread_pool.groups_per_thread);
 
+    // glibc unregisters these handlers automatically if the loader is dlclose()d, as it does those of the
+    // memory pool, coder pool and caches below.  Unlike the workers, what those hold is plain memory that's
+    // still usable in a child process, so their handlers only need to keep the lock consistent over a fork.
+    if(pthread_atfork(thread_pool_atfork_prepare, thread_pool_atfork_parent, thread_pool_atfork_child) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+/**
+ * @brief Find the job an idle worker should help with next.  Called with the pool locked.
+ *
+ * @return The job with work left and room for another helper that has the fewest helpers,
+ *         or @c NULL if there isn't one.
+ */
+static pool_job *thread_pool_pick_job(void)
+{
+    pool_job *best = NULL;
+    for(pool_job *job = thread_pool.jobs; job; job = job->next)
     {
-        char *lang_test = getenv("LANG");
-        if(lang_test)
-        {
-            char lang_env[20];
-            snprintf(lang_env, sizeof(lang_env), "%s", lang_test);
-            char *lang_end = strchr(lang_env, '_');
-            if(lang_end)
-            {
-                *lang_end = '\0';
-                char *country_end = strchr(lang_end+1, '.');
-                if(country_end)
-                {
-                    *country_end = '\0';
-                    lang = lang_env;
-                    country = lang_end + 1;
-                    DEBUG_PRINTF("Got lang \"%s\", country \"%s\" from environment", lang, country);
-                }
-            }
-        }
+        if(job->helpers < job->max_helpers &&
+           atomic_load_explicit(&job->next_value, memory_order_relaxed) < job->end &&
+           (!best || job->helpers < best->helpers))
+            best = job;
     }
+    return best;
+}
 
-    const cmsInfoType infoType = cmsInfoDescription;
+static void *thread_pool_worker(void *arg)
+{
+    (void)arg;
 
-    cmsUInt32Number required = cmsGetProfileInfoASCII(icc, infoType, lang, country, NULL, 0);
-    if(!(retval = malloc(required)))
-        RETURN_ERR(NULL, "Failed to allocate %u B for ICC description", (unsigned)required);
+    pthread_mutex_lock(&thread_pool.lock);
+    while(!thread_pool.shutdown)
+    {
+        pool_job *job = thread_pool_pick_job();
+        if(!job && thread_pool.tasks)
+        {
+            // Nothing to help with, so get on with some background work
+            pool_task *task = thread_pool.tasks;
+            thread_pool.tasks = task->next;
+            pthread_mutex_unlock(&thread_pool.lock);
+            task->func(task->arg);
+            pthread_mutex_lock(&thread_pool.lock);
+            continue;
+        }
+        if(!job)
+        {
+            thread_pool.num_idle++;
+            pthread_cond_wait(&thread_pool.work, &thread_pool.lock);
+            thread_pool.num_idle--;
+            continue;
+        }
 
-    cmsGetProfileInfoASCII(icc, infoType, lang, country, retval, required);
+        // Take the lowest free thread id; there's always one, because there are max_helpers + 1
+        unsigned id = 1;
+        while(job->ids_in_use[id / 64] & (1ull << (id % 64)))
+            ++id;
+        job->ids_in_use[id / 64] |= 1ull << (id % 64);
+        job->helpers++;
+        if(!job->first_helped)
+            job->first_helped = now_ns();
+        const unsigned generation = atomic_load(&thread_pool.generation);
+        pthread_mutex_unlock(&thread_pool.lock);
 
-ret:
-    return retval;
+        // Work until the job runs out, or another job starts or finishes and the shares need rebalancing
+        uint32_t value;
+        while(!atomic_load_explicit(job->cancelled, memory_order_relaxed) &&
+              (value = atomic_fetch_add_explicit(&job->next_value, 1, memory_order_relaxed)) < job->end)
+        {
+            job->func(job->jpegxl_opaque, value, id);
+            if(atomic_load_explicit(&thread_pool.generation, memory_order_relaxed) != generation)
+                break;
+        }
+
+        pthread_mutex_lock(&thread_pool.lock);
+        job->ids_in_use[id / 64] &= ~(1ull << (id % 64));
+        if(--job->helpers == 0)
+            pthread_cond_broadcast(&thread_pool.helper_done);
+    }
+    pthread_mutex_unlock(&thread_pool.lock);
+    return NULL;
 }
-#endif // IMLIB2JXL_DEBUG
 
+/**
+ * Stop the workers when the loader is unloaded (or the process exits).
+ * They must be gone before the loader's code is unmapped.
+ */
+__attribute__((destructor))
+static void thread_pool_cleanup(void)
+{
+    pthread_mutex_lock(&thread_pool.lock);
+    thread_pool.shutdown = true;
+    pthread_cond_broadcast(&thread_pool.work);
+    const unsigned num_workers = thread_pool.num_workers;
+    thread_pool.num_workers = 0;
+    pthread_mutex_unlock(&thread_pool.lock);
+
+    for(unsigned i = 0; i < num_workers; ++i)
+        pthread_join(thread_pool.workers[i], NULL);
+}
 
 /**
- * @brief Convert pixels to sRGB from whatever profile they're currently using.
+ * @brief JxlParallelRunner that runs work on the shared worker threads.
  *
- * The input is always 8-bit interleaved channels in a fixed order. The format is indicated by @p num_channels:
- * - num_channels == 1 : Gray
- * - num_channels == 2 : Gray + Alpha
- * - num_channels == 3 : RGB
- * - num_channels == 4 : RGB + Alpha
- * 
- * The output is always word-ordered ARGB, 4 bytes per pixel, as expected by imlib2.
- * 
- * TODO: Transforming integer pixels will incur rounding errors, but would using a float buffer be worth the overhead?
- * 
- * @param[in] input_icc_blob Pointer to ICC profile blob representing the current profile.
- * @param[in] icc_blob_size Number of bytes in the profile referenced by @p input_icc_blob.
- * @param[in] px_in Pointer to current pixel data.
- * @param[out] px_out Pointer to a buffer where the transformed pixel data will be written.
- * @param[in] num_pixels Number of pixels to transform. @p px_out should be at least `4 * num_pixels` bytes long.
+ * The calling thread works on the range too, so progress never depends on a worker being free.
+ * Once the runner has been cancelled, the rest of the range is dropped and the call fails.
  *
- * @return 0 on success.
+ * @param[in] runner_opaque A pool_runner from runner_acquire().
  */
-static int convert_to_srgb(uint8_t *input_icc_blob, size_t icc_blob_size, const void *px_in, void *px_out, size_t num_pixels, int num_channels)
+static JxlParallelRetCode pool_run(void *runner_opaque, void *jpegxl_opaque, JxlParallelRunInit init,
+                                   JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range)
 {
-    int retval = -1;
-    cmsHPROFILE source_icc = NULL;
-    cmsHPROFILE srgb_icc = NULL;
-    cmsHTRANSFORM trans = NULL;
-    cmsContext ctx = NULL;
-    //cmsToneCurve* srgb_tonecurve = NULL;
-#ifdef IMLIB2JXL_DEBUG
-    char *src_icc_name = NULL;
-    char *dst_icc_name = NULL;
-#endif
-    
-    if(!(ctx = cmsCreateContext(NULL, NULL)))
-        RETURN_ERR(-1, "Failed to create lcms context");
+    pool_runner *runner = runner_opaque;
+    const uint32_t count = (end_range > start_range) ? end_range - start_range : 0;
 
-    if(!(source_icc = cmsOpenProfileFromMemTHR(ctx, input_icc_blob, icc_blob_size)))
-        RETURN_ERR(-1, "Failed to create color profile from %zu B ICC data", icc_blob_size);
+    pthread_once(&thread_pool.once, thread_pool_init);
 
-    if(!(srgb_icc = cmsCreate_sRGBProfileTHR(ctx)))
-        RETURN_ERR(-1, "Failed to create sRGB color profile");
-    
-    cmsUInt32Number input_format;
-    switch(num_channels)
+    unsigned max_helpers = (runner->max_helpers < thread_pool.budget) ? runner->max_helpers : thread_pool.budget;
+    if(count <= max_helpers)
+        max_helpers = (count > 0) ? count - 1 : 0;
+
+    JxlParallelRetCode rc;
+    if((rc = init(jpegxl_opaque, max_helpers + 1)) != 0)
+        return rc;
+
+    if(max_helpers == 0)
     {
-        case 3: input_format = TYPE_RGB_8; break;
-        case 4: input_format = TYPE_RGBA_8; break;
-        case 1: input_format = TYPE_GRAY_8; break;
-        case 2: input_format = TYPE_GRAYA_8; break;
-        default:
-            RETURN_ERR(-1, "Unsupported number of channels (%d)", num_channels);
+        for(uint32_t value = start_range; value < end_range && !atomic_load_explicit(&runner->cancelled, memory_order_relaxed); ++value)
+            func(jpegxl_opaque, value, 0);
+        return atomic_load(&runner->cancelled) ? -1 : 0;
     }
-    
-    //if(is_gray)
-    //{
-    //    // No convenient function for creating a gray sRGB profile, so have to build it.
-    //    static const cmsCIExyY d65 = {0.3127, 0.3291, 1.0};
-    //    static const cmsFloat64Number srgbCurveParams[] = {2.4, 1.0 / 1.055, 0.055 / 1.055, 1.0 / 12.92, 0.04045};
-    //    if(!(srgb_tonecurve =  cmsBuildParametricToneCurve(ctx, 4/*sRGB*/, srgbCurveParams)))
-    //        RETURN_ERR(-1, "Failed to create sRGB tone curve");
-    //    if(!(srgb_icc = cmsCreateGrayProfileTHR(ctx, &d65, srgb_tonecurve)))
-    //        RETURN_ERR(-1, "Failed to create sRGB color profile");
-    //    input_format = TYPE_GRAYA_8;
-    //}
 
-#ifdef IMLIB2JXL_DEBUG
-    if((src_icc_name = get_icc_description(source_icc)) &&
-       (dst_icc_name = get_icc_description(srgb_icc)))
+    pool_job job = {
+                       .jpegxl_opaque = jpegxl_opaque,
+                       .func = func,
+                       .end = end_range,
+                       .cancelled = &runner->cancelled,
+                       .max_helpers = max_helpers,
+                       .ids_in_use = { 1 },
+                       .submitted = now_ns()
+                   };
+    atomic_init(&job.next_value, start_range);
+
+    pthread_mutex_lock(&thread_pool.lock);
+    job.next = thread_pool.jobs;
+    thread_pool.jobs = &job;
+    atomic_fetch_add(&thread_pool.generation, 1);
+
+    // Start more workers if there aren't enough idle ones, up to the budget.  Once the pool has been
+    // shut down, none are started, since nothing would join them: the job is left to this thread.
+    unsigned wanted = max_helpers;
+    while(!thread_pool.shutdown && thread_pool.num_idle < wanted && thread_pool.num_workers < thread_pool.budget)
     {
-        DEBUG_PRINTF("Converting color space [%s] -> [%s]; num_pixels=%zu num_channels=%d",
-                     src_icc_name, dst_icc_name, num_pixels, num_channels);
+        if(pthread_create(&thread_pool.workers[thread_pool.num_workers], NULL, thread_pool_worker, NULL) != 0)
+        {
+            WARN_PRINTF("Failed to start a worker thread");
+            break;
+        }
+        thread_pool.num_workers++;
+        wanted--;
     }
-#endif
+    pthread_cond_broadcast(&thread_pool.work);
+    pthread_mutex_unlock(&thread_pool.lock);
 
-    // To avoid shuffling the channels again later, set the output format to the required TYPE_ARGB_8
+    uint32_t value;
+    while(!atomic_load_explicit(&runner->cancelled, memory_order_relaxed) &&
+          (value = atomic_fetch_add_explicit(&job.next_value, 1, memory_order_relaxed)) < end_range)
+        func(jpegxl_opaque, value, 0);
 
-    if(!(trans = cmsCreateTransformTHR(ctx, source_icc, input_format, srgb_icc,
-                                       IS_BIG_ENDIAN() ? TYPE_ARGB_8 : TYPE_BGRA_8,
-                                       cmsGetHeaderRenderingIntent(source_icc), cmsFLAGS_COPY_ALPHA)))
+    pthread_mutex_lock(&thread_pool.lock);
+    while(job.helpers > 0)
+        pthread_cond_wait(&thread_pool.helper_done, &thread_pool.lock);
+    for(pool_job **link = &thread_pool.jobs; *link; link = &(*link)->next)
     {
-#ifdef IMLIB2JXL_DEBUG
-        char *from = get_icc_description(source_icc);
-        char *to = get_icc_description(srgb_icc);
-        DEBUG_PRINTF("Failed to create color transformation [%s] -> [%s]", from, to);
-        free(from);
-        free(to);
-#endif
-        goto ret;
+        if(*link == &job)
+        {
+            *link = job.next;
+            break;
+        }
     }
+    atomic_fetch_add(&thread_pool.generation, 1);
+    pthread_mutex_unlock(&thread_pool.lock);
 
-    cmsDoTransform(trans, px_in, px_out, num_pixels);
-    retval = 0;
+    // How long the job waited for its first helper - all of it, if no worker was ever free
+    const uint64_t delay_us = ((job.first_helped ? job.first_helped : now_ns()) - job.submitted) / 1000;
+    STATS_INC(pool_jobs);
+    STATS_ADD(pool_queue_us, delay_us);
+    STATS_MAX(pool_queue_max_us, delay_us);
+    if(!job.first_helped)
+        STATS_INC(pool_unhelped_jobs);
 
-ret:
-    if(trans)
-        cmsDeleteTransform(trans);
-    if(srgb_icc)
-        cmsCloseProfile(srgb_icc);
-    if(source_icc)
-        cmsCloseProfile(source_icc);
-    //if(srgb_tonecurve)
-    //    cmsFreeToneCurve(srgb_tonecurve);
-    if(ctx)
-        cmsDeleteContext(ctx);
-#ifdef IMLIB2JXL_DEBUG
-    free(src_icc_name);
-    free(dst_icc_name);
-#endif
-    return retval;
+    return atomic_load(&runner->cancelled) ? -1 : 0;
 }
 
-
 /**
- * Return true if vectors are "roughly" equal.
- * i.e. no component differs by >= 2e-5.
- * This threshold is completely arbitrary.
+ * @brief Get a handle for running work on the shared worker threads.
  *
- * @param[in] length Dimension of both vectors.
- * @param[in] v1,v2 Arrays of length @p length to compare.
+ * The handle must be given back with runner_release() when the caller has finished with its
+ * decoder or encoder.
+ *
+ * @param[in] max_threads Maximum number of threads to use for each piece of work, counting the
+ *                        calling thread, or -1 to allow the whole budget.
+ *
+ * @return Opaque runner for use with pool_run(), or @c NULL on failure.
  */
-static bool near_equal(unsigned length, const double *v1, const double *v2)
+static void *runner_acquire(int max_threads)
 {
-  for(unsigned i=0; i<length; ++i)
-  {
-      if(fabs(v1[i]-v2[i]) >= .00002)
-          return false;
-  }
-  return true;
+    pool_runner *runner;
+    if(!(runner = malloc(sizeof(*runner))))
+        return NULL;
+    runner->max_helpers = (max_threads < 0) ? THREAD_BUDGET_MAX :
+                          (max_threads > 1) ? (unsigned)max_threads - 1 : 0;
+    atomic_init(&runner->cancelled, false);
+    return runner;
 }
 
-#endif // IMLIB2JXL_USE_LCMS
-
-
-static int load(ImlibImage* im, int load_data)
+/**
+ * @brief Limit the threads used by @p runner to as many as an image can keep busy.
+ *
+ * Each thread gets at least IMLIB2_JXL_GROUPS_PER_THREAD groups, so images of only a few groups are
+ * handled entirely by the calling thread.  The limit never goes back up.
+ *
+ * @param[in,out] runner Runner from runner_acquire().  May be @c NULL.
+ * @param[in] width,height Dimensions of the image being decoded or encoded.
+ */
+static void runner_fit_image(void *runner, size_t width, size_t height)
 {
-    DEBUG_PRINTF("Load [%s][%zu]", im->fi->name, (size_t)im->fi->fsize);
+    pool_runner *pr = runner;
+    if(!pr)
+        return;
 
-    int retval = LOAD_FAIL;
-    JxlDecoder *dec = NULL;
-    void *runner = NULL;
-    uint8_t *target = NULL;
+    pthread_once(&thread_pool.once, thread_pool_init);
 
-#ifdef IMLIB2JXL_USE_LCMS
-    uint8_t *icc_blob = NULL;
-    size_t icc_size = 0;
-    const int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE | JXL_DEC_COLOR_ENCODING;
-#else
-    const int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
-#endif
+    const size_t groups = ((width + GROUP_DIM - 1) / GROUP_DIM) * ((height + GROUP_DIM - 1) / GROUP_DIM);
+    const size_t threads = groups / thread_pool.groups_per_thread;
+    const unsigned helpers = (threads <= 1) ? 0 :
+                             (threads > THREAD_BUDGET_MAX) ? THREAD_BUDGET_MAX :
+                              threads - 1;
+    if(helpers < pr->max_helpers)
+        pr->max_helpers = helpers;
+    DEBUG_PRINTF("%zux%zu image has %zu groups; using up to %u helper threads", width, height, groups, pr->max_helpers);
+}
 
-    // Initialize decoder
-    if(!(dec = JxlDecoderCreate(NULL)))
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderCreate");
+/**
+ * @brief Release a runner obtained from runner_acquire().
+ *
+ * @param[in] runner Runner to release.  May be @c NULL.
+ */
+static void runner_release(void *runner)
+{
+    free(runner);
+}
+
+// Everything from here on is left out of jxl-calibrate
+#ifndef IMLIB2JXL_POOL_ONLY
 
-    if(!(runner = JxlThreadParallelRunnerCreate(NULL, JxlThreadParallelRunnerDefaultNumWorkerThreads())))
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlThreadParallelRunnerCreate");
+/**
+ * @brief Make the work running on @p runner stop as soon as possible.
+ *
+ * No more of the current range is handed out, and this and every later pool_run() call fails, so
+ * libjxl gives up on the decode.
+ *
+ * @param[in,out] runner Runner from runner_acquire().  May be @c NULL.
+ */
+static void runner_cancel(void *runner)
+{
+    pool_runner *pr = runner;
+    if(pr)
+        atomic_store(&pr->cancelled, true);
+}
 
-    if(JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner) != JXL_DEC_SUCCESS)
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetParallelRunner");
+/**
+ * @brief Queue a task to be run by a worker thread when there's one free.
+ *
+ * Tasks run in the order they're submitted, but only when a worker has no job to help with.
+ *
+ * @param[in] task The task, which must stay valid until it has run or been cancelled.
+ *
+ * @return 0 on success, or -1 if there are no worker threads to run it.
+ */
+static int pool_task_submit(pool_task *task)
+{
+    pthread_once(&thread_pool.once, thread_pool_init);
+
+    pthread_mutex_lock(&thread_pool.lock);
+    if(thread_pool.shutdown)
+    {
+        pthread_mutex_unlock(&thread_pool.lock);
+        return -1;
+    }
+
+    if(thread_pool.num_idle == 0 && thread_pool.num_workers < thread_pool.budget)
+    {
+        if(pthread_create(&thread_pool.workers[thread_pool.num_workers], NULL, thread_pool_worker, NULL) == 0)
+            thread_pool.num_workers++;
+        else
+            WARN_PRINTF("Failed to start a worker thread");
+    }
+    if(thread_pool.num_workers == 0)
+    {
+        pthread_mutex_unlock(&thread_pool.lock);
+        return -1;
+    }
+
+    pool_task **link = &thread_pool.tasks;
+    while(*link)
+        link = &(*link)->next;
+    task->next = NULL;
+    *link = task;
+    pthread_cond_signal(&thread_pool.work);
+    pthread_mutex_unlock(&thread_pool.lock);
+    return 0;
+}
+
+/**
+ * @brief Take a task off the queue if it hasn't started yet.
+ *
+ * @return true if it was waiting and has been removed; false if it's running, or wasn't submitted.
+ */
+static bool pool_task_cancel(pool_task *task)
+{
+    bool removed = false;
+
+    pthread_mutex_lock(&thread_pool.lock);
+    for(pool_task **link = &thread_pool.tasks; *link; link = &(*link)->next)
+    {
+        if(*link == task)
+        {
+            *link = task->next;
+            removed = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_pool.lock);
+    return removed;
+}
+
+
+/* Memory
+ *
+ * libjxl allocates and frees large buffers for every image.  Rather than returning them to the heap,
+ * where they fragment it in long-running processes, blocks above a minimum size are kept in a
+ * process-wide pool of size classes and reused by later images.  Each decoder or encoder also
+ * counts its current and peak usage.
+ */
+
+/**
+ * Blocks smaller than 2^MEM_POOL_MIN_SHIFT bytes come straight from malloc, as do blocks larger
+ * than 2^MEM_POOL_MAX_SHIFT.
+ */
+#define MEM_POOL_MIN_SHIFT 16
+#define MEM_POOL_MAX_SHIFT 30
+#define MEM_POOL_MIN_BLOCK ((size_t)1 << MEM_POOL_MIN_SHIFT)
+#define MEM_POOL_MAX_BLOCK ((size_t)1 << MEM_POOL_MAX_SHIFT)
+
+/**
+ * Default limit on the memory held by the pool, in MiB.
+ */
+#define MEM_POOL_DEFAULT_MIB 64
+
+/**
+ * Size classes are spaced four to each power of two, so no more than 25% of a block is wasted.
+ */
+#define MEM_CLASSES_PER_OCTAVE 4
+#define MEM_NUM_CLASSES ((MEM_POOL_MAX_SHIFT - MEM_POOL_MIN_SHIFT) * MEM_CLASSES_PER_OCTAVE + 1)
+
+/**
+ * Alignment of every block from mem_alloc(): a cache line, which is also enough for any SIMD
+ * loads libjxl does.
+ */
+#define MEM_ALIGNMENT 64
+
+/**
+ * Space before each block handed to libjxl.  Blocks are allocated at MEM_ALIGNMENT, and the header
+ * is the same size, so the part libjxl gets is aligned too.
+ */
+#define MEM_HEADER_SIZE MEM_ALIGNMENT
+
+/**
+ * Header of every block from mem_alloc().
+ */
+typedef struct mem_block
+{
+    struct mem_block *next;  ///< Next free block of the same class, while in the pool
+    size_t size;             ///< Usable size of the block
+    int size_class;          ///< Index of the block's size class, or -1 if it isn't pooled
+} mem_block;
+
+/**
+ * Memory usage of one decoder or encoder.
+ *
+ * A pooled decoder or encoder is only used by one call at a time, and @c peak is reset to @c current
+ * when it's acquired, so after a call @c peak is that call's peak (including anything the reset
+ * decoder or encoder kept from earlier calls).
+ */
+typedef struct
+{
+    atomic_size_t current;
+    atomic_size_t peak;
+} mem_tracker;
+
+/**
+ * Process-wide pool of free blocks.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    size_t limit;                         ///< Maximum number of bytes to hold
+    size_t held;                          ///< Number of bytes held
+    bool closed;                          ///< Set once the loader is being unloaded, so nothing more is held
+    mem_block *free[MEM_NUM_CLASSES];     ///< Free blocks of each size class
+} mem_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static void mem_pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&mem_pool.lock);
+}
+
+static void mem_pool_atfork_release(void)
+{
+    pthread_mutex_unlock(&mem_pool.lock);
+}
+
+static void mem_pool_init(void)
+{
+    const char *env = getenv("IMLIB2_JXL_MEMORY_POOL");
+    const unsigned long mib = env ? strtoul(env, NULL, 10) : MEM_POOL_DEFAULT_MIB;
+    mem_pool.limit = (mib < SIZE_MAX / (1024 * 1024)) ? mib * 1024 * 1024 : SIZE_MAX;
+    DEBUG_PRINTF("Memory pool limit: %lu MiB", mib);
+
+    if(pthread_atfork(mem_pool_atfork_prepare, mem_pool_atfork_release, mem_pool_atfork_release) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+/**
+ * Free the pooled blocks when the loader is unloaded (or the process exits).
+ */
+__attribute__((destructor))
+static void mem_pool_cleanup(void)
+{
+    pthread_mutex_lock(&mem_pool.lock);
+    for(int i = 0; i < MEM_NUM_CLASSES; ++i)
+    {
+        while(mem_pool.free[i])
+        {
+            mem_block *block = mem_pool.free[i];
+            mem_pool.free[i] = block->next;
+            free(block);
+        }
+    }
+    mem_pool.held = 0;
+    mem_pool.closed = true;
+    pthread_mutex_unlock(&mem_pool.lock);
+}
+
+/**
+ * @brief Find the size class for a block of at least @p size bytes.
+ *
+ * @param[in,out] size Requested size, rounded up to the size of the class on return.
+ *
+ * @return Index of the class, or -1 if blocks of this size aren't pooled.
+ */
+static int mem_size_class(size_t *size)
+{
+    if(*size < MEM_POOL_MIN_BLOCK || *size > MEM_POOL_MAX_BLOCK)
+        return -1;
+
+    // Octave of the size above the minimum, then the step within it
+    int octave = 0;
+    while((MEM_POOL_MIN_BLOCK << (octave + 1)) <= *size)
+        ++octave;
+    const size_t base = MEM_POOL_MIN_BLOCK << octave;
+    const size_t step = base / MEM_CLASSES_PER_OCTAVE;
+    const size_t steps = (*size - base + step - 1) / step;
+
+    *size = base + steps * step;
+    return octave * MEM_CLASSES_PER_OCTAVE + (int)steps;
+}
+
+static void mem_track(mem_tracker *tracker, size_t size, bool alloc)
+{
+    if(!tracker)
+        return;
+    if(!alloc)
+    {
+        atomic_fetch_sub_explicit(&tracker->current, size, memory_order_relaxed);
+        return;
+    }
+
+    const size_t current = atomic_fetch_add_explicit(&tracker->current, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&tracker->peak, memory_order_relaxed);
+    while(current > peak &&
+          !atomic_compare_exchange_weak_explicit(&tracker->peak, &peak, current, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/**
+ * @brief libjxl allocation function, taking large blocks from the pool where possible.
+ *
+ * @param[in] opaque The mem_tracker to charge the block to, or @c NULL.
+ */
+static void *mem_alloc(void *opaque, size_t size)
+{
+    pthread_once(&mem_pool.once, mem_pool_init);
+
+    if(size > SIZE_MAX - MEM_HEADER_SIZE)
+        return NULL;
+
+    const int size_class = mem_size_class(&size);
+    mem_block *block = NULL;
+
+    if(size_class >= 0)
+    {
+        pthread_mutex_lock(&mem_pool.lock);
+        if((block = mem_pool.free[size_class]))
+        {
+            mem_pool.free[size_class] = block->next;
+            mem_pool.held -= block->size;
+        }
+        pthread_mutex_unlock(&mem_pool.lock);
+        if(block)
+            STATS_INC(mem_pool_hits);
+        else
+            STATS_INC(mem_pool_misses);
+    }
+
+    if(!block)
+    {
+        void *memory;
+        if(posix_memalign(&memory, MEM_ALIGNMENT, MEM_HEADER_SIZE + size) != 0)
+            return NULL;
+        block = memory;
+        block->size = size;
+        block->size_class = size_class;
+    }
+
+    mem_track(opaque, block->size, true);
+    return (uint8_t*)block + MEM_HEADER_SIZE;
+}
+
+/**
+ * @brief libjxl free function, keeping large blocks in the pool while it has room.
+ */
+static void mem_free(void *opaque, void *address)
+{
+    if(!address)
+        return;
+
+    mem_block *block = (mem_block*)((uint8_t*)address - MEM_HEADER_SIZE);
+    mem_track(opaque, block->size, false);
+
+    if(block->size_class >= 0)
+    {
+        pthread_mutex_lock(&mem_pool.lock);
+        if(!mem_pool.closed && mem_pool.held + block->size <= mem_pool.limit)
+        {
+            block->next = mem_pool.free[block->size_class];
+            mem_pool.free[block->size_class] = block;
+            mem_pool.held += block->size;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&mem_pool.lock);
+    }
+
+    free(block);
+}
+
+/**
+ * @brief Make a memory manager for a decoder or encoder that uses the pool.
+ *
+ * @param[in] tracker Where to count the decoder or encoder's memory use, or @c NULL not to.
+ */
+static JxlMemoryManager mem_manager(mem_tracker *tracker)
+{
+    return (JxlMemoryManager){ .opaque = tracker, .alloc = mem_alloc, .free = mem_free };
+}
+
+/**
+ * @brief Record the peak memory use of a finished load or save.
+ *
+ * @param[in] tracker The tracker of the call's decoder or encoder, which holds that call's peak.
+ */
+static void mem_report(const mem_tracker *tracker, const char *what)
+{
+    const size_t peak = atomic_load_explicit(&tracker->peak, memory_order_relaxed);
+    DEBUG_PRINTF("Peak libjxl memory use for %s: %zu B", what, peak);
+    (void)what;
+
+    STATS_INC(mem_tracked);
+    STATS_ADD(mem_peak_total, peak);
+    STATS_MAX(mem_peak_max, peak);
+}
+
+
+/* Decoder and encoder pool
+ *
+ * Decoders and encoders are reset and kept for reuse by later loads and saves, which saves
+ * setting them up for every image.  Each one has its own memory tracker, since the memory manager
+ * given to libjxl at creation stays with it for life.
+ */
+
+/**
+ * Maximum number of idle decoders, and of idle encoders, kept for reuse.
+ */
+#define CODER_POOL_MAX_IDLE 4
+
+/**
+ * Largest output buffer kept with an idle encoder.
+ */
+#define CODER_POOL_MAX_BUFFER (4 * 1024 * 1024)
+
+typedef struct
+{
+    JxlDecoder *dec;
+    mem_tracker memory;  ///< Memory use of @c dec
+} pooled_decoder;
+
+typedef struct
+{
+    JxlEncoder *enc;
+    mem_tracker memory;  ///< Memory use of @c enc
+    uint8_t *buffer;     ///< Output buffer kept for the next save, or @c NULL
+    size_t buffer_size;
+} pooled_encoder;
+
+/**
+ * Process-wide pool of idle decoders and encoders.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pooled_decoder *decoders[CODER_POOL_MAX_IDLE];
+    unsigned num_decoders;
+    pooled_encoder *encoders[CODER_POOL_MAX_IDLE];
+    unsigned num_encoders;
+} coder_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static void coder_pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&coder_pool.lock);
+}
+
+static void coder_pool_atfork_release(void)
+{
+    pthread_mutex_unlock(&coder_pool.lock);
+}
+
+static void coder_pool_init(void)
+{
+    if(pthread_atfork(coder_pool_atfork_prepare, coder_pool_atfork_release, coder_pool_atfork_release) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+static void decoder_destroy(pooled_decoder *pd)
+{
+    JxlDecoderDestroy(pd->dec);
+    free(pd);
+}
+
+static void encoder_destroy(pooled_encoder *pe)
+{
+    JxlEncoderDestroy(pe->enc);
+    free(pe->buffer);
+    free(pe);
+}
+
+/**
+ * Destroy the idle decoders and encoders when the loader is unloaded (or the process exits).
+ */
+__attribute__((destructor))
+static void coder_pool_cleanup(void)
+{
+    pthread_mutex_lock(&coder_pool.lock);
+    while(coder_pool.num_decoders > 0)
+        decoder_destroy(coder_pool.decoders[--coder_pool.num_decoders]);
+    while(coder_pool.num_encoders > 0)
+        encoder_destroy(coder_pool.encoders[--coder_pool.num_encoders]);
+    pthread_mutex_unlock(&coder_pool.lock);
+}
+
+/**
+ * @brief Take a decoder from the pool, creating one if none are idle.
+ *
+ * The decoder is in the same state as a new one, and must be given back with decoder_release().
+ *
+ * @return The decoder, or @c NULL on failure.
+ */
+static pooled_decoder *decoder_acquire(void)
+{
+    pooled_decoder *pd = NULL;
+
+    pthread_once(&coder_pool.once, coder_pool_init);
+
+    pthread_mutex_lock(&coder_pool.lock);
+    if(coder_pool.num_decoders > 0)
+        pd = coder_pool.decoders[--coder_pool.num_decoders];
+    pthread_mutex_unlock(&coder_pool.lock);
+
+    if(pd)
+    {
+        // Only count the peak from here on
+        atomic_store(&pd->memory.peak, atomic_load(&pd->memory.current));
+        return pd;
+    }
+
+    if(!(pd = malloc(sizeof(*pd))))
+        return NULL;
+    atomic_init(&pd->memory.current, 0);
+    atomic_init(&pd->memory.peak, 0);
+    const JxlMemoryManager memory_manager = mem_manager(&pd->memory);
+    if(!(pd->dec = JxlDecoderCreate(&memory_manager)))
+    {
+        free(pd);
+        return NULL;
+    }
+    return pd;
+}
+
+/**
+ * @brief Reset a decoder from decoder_acquire() and return it to the pool.
+ *
+ * @param[in] pd Decoder to release.  May be @c NULL.
+ */
+static void decoder_release(pooled_decoder *pd)
+{
+    if(!pd)
+        return;
+
+    JxlDecoderReset(pd->dec);
+
+    pthread_mutex_lock(&coder_pool.lock);
+    if(coder_pool.num_decoders < CODER_POOL_MAX_IDLE)
+    {
+        coder_pool.decoders[coder_pool.num_decoders++] = pd;
+        pd = NULL;
+    }
+    pthread_mutex_unlock(&coder_pool.lock);
+
+    if(pd)
+        decoder_destroy(pd);
+}
+
+/**
+ * @brief Take an encoder from the pool, creating one if none are idle.
+ *
+ * The encoder is in the same state as a new one, and must be given back with encoder_release().
+ * It may come with an output buffer from a previous save.
+ *
+ * @return The encoder, or @c NULL on failure.
+ */
+static pooled_encoder *encoder_acquire(void)
+{
+    pooled_encoder *pe = NULL;
+
+    pthread_once(&coder_pool.once, coder_pool_init);
+
+    pthread_mutex_lock(&coder_pool.lock);
+    if(coder_pool.num_encoders > 0)
+        pe = coder_pool.encoders[--coder_pool.num_encoders];
+    pthread_mutex_unlock(&coder_pool.lock);
+
+    if(pe)
+    {
+        atomic_store(&pe->memory.peak, atomic_load(&pe->memory.current));
+        return pe;
+    }
+
+    if(!(pe = malloc(sizeof(*pe))))
+        return NULL;
+    atomic_init(&pe->memory.current, 0);
+    atomic_init(&pe->memory.peak, 0);
+    pe->buffer = NULL;
+    pe->buffer_size = 0;
+    const JxlMemoryManager memory_manager = mem_manager(&pe->memory);
+    if(!(pe->enc = JxlEncoderCreate(&memory_manager)))
+    {
+        free(pe);
+        return NULL;
+    }
+    return pe;
+}
+
+/**
+ * @brief Reset an encoder from encoder_acquire() and return it to the pool.
+ *
+ * @param[in] pe Encoder to release.  May be @c NULL.
+ * @param[in] buffer,buffer_size Output buffer to keep with the encoder for the next save, in place of
+ *                               the one it has.  It's freed instead if it's too big to keep or the
+ *                               pool is full.  If @c NULL (the save failed before taking the
+ *                               encoder's buffer, say), the encoder keeps the one it has.
+ */
+static void encoder_release(pooled_encoder *pe, uint8_t *buffer, size_t buffer_size)
+{
+    if(!pe)
+    {
+        free(buffer);
+        return;
+    }
+
+    JxlEncoderReset(pe->enc);
+    if(buffer)
+    {
+        free(pe->buffer);
+        pe->buffer = NULL;
+        pe->buffer_size = 0;
+        if(buffer_size <= CODER_POOL_MAX_BUFFER)
+        {
+            pe->buffer = buffer;
+            pe->buffer_size = buffer_size;
+        }
+        else
+        {
+            free(buffer);
+        }
+    }
+
+    pthread_mutex_lock(&coder_pool.lock);
+    if(coder_pool.num_encoders < CODER_POOL_MAX_IDLE)
+    {
+        coder_pool.encoders[coder_pool.num_encoders++] = pe;
+        pe = NULL;
+    }
+    pthread_mutex_unlock(&coder_pool.lock);
+
+    if(pe)
+        encoder_destroy(pe);
+}
+
+
+/* Per-call timing
+ *
+ * If IMLIB2_JXL_TIMING is set, each load and save measures the time it spends in each phase and
+ * writes one line of key=value pairs when it finishes.  Otherwise, each measuring point costs a branch.
+ */
+
+/**
+ * Phases of a load or save.  Those marked as summed may run on several threads at once, so their
+ * total can exceed the time the call took.
+ */
+typedef enum
+{
+    PHASE_HEADER,   ///< Load: everything up to reading the basic info
+    PHASE_DECODE,   ///< Load: the rest of decoding, including the swizzle
+    PHASE_SWIZZLE,  ///< Load: converting libjxl's pixels to ARGB (summed)
+    PHASE_COLOR,    ///< Load: transforming to sRGB
+    PHASE_SCAN,     ///< Save: looking for channels that needn't be encoded
+    PHASE_COPY,     ///< Save: converting ARGB to libjxl's pixels (summed)
+    PHASE_ENCODE,   ///< Save: encoding, including the copy and write where libjxl calls for them
+    PHASE_WRITE,    ///< Save: writing the encoded bytes (summed)
+    NUM_PHASES
+} timing_phase;
+
+static const char* const timing_phase_names[NUM_PHASES] = {
+    "header", "decode", "swizzle", "color", "scan", "copy", "encode", "write"
+};
+
+#define TIMING_LOAD_PHASES ((1u << PHASE_HEADER) | (1u << PHASE_DECODE) | (1u << PHASE_SWIZZLE) | (1u << PHASE_COLOR))
+#define TIMING_SAVE_PHASES ((1u << PHASE_SCAN) | (1u << PHASE_COPY) | (1u << PHASE_ENCODE) | (1u << PHASE_WRITE))
+
+/**
+ * Measurements of one load or save.
+ */
+typedef struct
+{
+    bool enabled;
+    uint64_t start;                       ///< now_ns() when the call started
+    atomic_uint_fast64_t ns[NUM_PHASES];  ///< Time spent in each phase
+    size_t bytes;                         ///< Size of the JPEG XL data read or written
+    size_t pixels;                        ///< Number of pixels loaded or saved
+} call_timing;
+
+/**
+ * The IMLIB2_JXL_TIMING setting, read once, by the first call, since another thread could be
+ * changing the environment.
+ */
+static struct
+{
+    pthread_once_t once;
+    bool enabled;
+    char path[PATH_MAX];  ///< File to append the lines to, or empty for stderr
+} timing_env = { .once = PTHREAD_ONCE_INIT };
+
+static void timing_env_init(void)
+{
+    const char *env = getenv("IMLIB2_JXL_TIMING");
+    timing_env.enabled = env && *env && strcmp(env, "0") != 0;
+    if(timing_env.enabled && strchr(env, '/'))
+    {
+        if(strlen(env) < sizeof(timing_env.path))
+            strcpy(timing_env.path, env);
+        else
+        {
+            WARN_PRINTF("IMLIB2_JXL_TIMING path is too long");
+            timing_env.enabled = false;
+        }
+    }
+}
+
+/**
+ * @brief Start measuring a call, if IMLIB2_JXL_TIMING asks for it.
+ */
+static void timing_begin(call_timing *timing)
+{
+    pthread_once(&timing_env.once, timing_env_init);
+    timing->enabled = timing_env.enabled;
+    timing->bytes = 0;
+    timing->pixels = 0;
+    for(int i = 0; i < NUM_PHASES; ++i)
+        atomic_init(&timing->ns[i], 0);
+    timing->start = timing->enabled ? now_ns() : 0;
+}
+
+/**
+ * @brief Read the clock, if @p timing is measuring.
+ *
+ * @param[in] timing The call being measured, or @c NULL.
+ *
+ * @return The time, to pass to timing_end_phase(), or 0 if not measuring.
+ */
+static inline uint64_t timing_now(const call_timing *timing)
+{
+    return (timing && timing->enabled) ? now_ns() : 0;
+}
+
+/**
+ * @brief Add the time since @p since to @p phase.  May be called from any thread.
+ *
+ * @param[in] timing The call being measured, or @c NULL.
+ */
+static inline void timing_end_phase(call_timing *timing, timing_phase phase, uint64_t since)
+{
+    if(timing && timing->enabled)
+        atomic_fetch_add_explicit(&timing->ns[phase], now_ns() - since, memory_order_relaxed);
+}
+
+/**
+ * @brief Write the line describing a finished call.
+ *
+ * The line goes to stderr, or is appended to a file if IMLIB2_JXL_TIMING is a path (containing a '/').
+ * The file name comes last, since it may contain spaces.
+ *
+ * @param[in] op "load" or "save".
+ * @param[in] phases Bits (1 << phase) of the phases to include.
+ * @param[in] status The call's return value.
+ * @param[in] peak_memory Peak libjxl memory use during this call, if known.
+ */
+static void timing_report(const call_timing *timing, const char *op, unsigned phases, int status,
+                          size_t peak_memory, const char *name)
+{
+    if(!timing->enabled)
+        return;
+
+    char line[512 + PATH_MAX];
+    int len = snprintf(line, sizeof(line), "imlib2-jxl timing: op=%s status=%d bytes=%zu pixels=%zu peak_mem=%zu",
+                       op, status, timing->bytes, timing->pixels, peak_memory);
+    for(int i = 0; i < NUM_PHASES && len < (int)sizeof(line); ++i)
+    {
+        if(phases & (1u << i))
+            len += snprintf(line + len, sizeof(line) - len, " %s_us=%" PRIu64, timing_phase_names[i],
+                            (uint64_t)atomic_load_explicit(&timing->ns[i], memory_order_relaxed) / 1000);
+    }
+    if(len < (int)sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, " total_us=%" PRIu64 " file=%s\n",
+                        (now_ns() - timing->start) / 1000, name ? name : "");
+    if(len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    // One write per line, so lines from concurrent calls (or processes sharing the file) don't mix
+    int fd = STDERR_FILENO;
+    if(timing_env.path[0] && (fd = open(timing_env.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+    {
+        WARN_PRINTF("Failed to open %s: %s", timing_env.path, strerror(errno));
+        return;
+    }
+    if(write(fd, line, len) != len)
+    {
+        DEBUG_PRINTF("Failed to write timing line");
+    }
+    if(fd != STDERR_FILENO)
+        close(fd);
+}
+
+
+#ifdef IMLIB2JXL_USE_LCMS
+
+
+#ifdef IMLIB2JXL_DEBUG
+/**
+ * @brief Get readable description of ICC profile.
+ *
+ * The caller is responsible for freeing the returned pointer.
+ *
+ * @return Pointer to allocated string, or @c NULL on failure.
+ */
+static char *get_icc_description(cmsHPROFILE icc)
+{
+    if(LCMS_VERSION != cmsGetEncodedCMMversion())
+        WARN_PRINTF("Warning: jxl loader was compiled against a different version of liblcms!");
+
+    char *retval = NULL;
+    const char *lang = "en";
+    const char *country = "US";
+
+    {
+        char *lang_test = getenv("LANG");
+        if(lang_test)
+        {
+            char lang_env[20];
+            snprintf(lang_env, sizeof(lang_env), "%s", lang_test);
+            char *lang_end = strchr(lang_env, '_');
+            if(lang_end)
+            {
+                *lang_end = '\0';
+                char *country_end = strchr(lang_end+1, '.');
+                if(country_end)
+                {
+                    *country_end = '\0';
+                    lang = lang_env;
+                    country = lang_end + 1;
+                    DEBUG_PRINTF("Got lang \"%s\", country \"%s\" from environment", lang, country);
+                }
+            }
+        }
+    }
+
+    const cmsInfoType infoType = cmsInfoDescription;
+
+    cmsUInt32Number required = cmsGetProfileInfoASCII(icc, infoType, lang, country, NULL, 0);
+    if(!(retval = malloc(required)))
+        RETURN_ERR(NULL, "Failed to allocate %u B for ICC description", (unsigned)required);
+
+    cmsGetProfileInfoASCII(icc, infoType, lang, country, retval, required);
+
+ret:
+    return retval;
+}
+#endif // IMLIB2JXL_DEBUG
+
+
+/**
+ * @brief Create a transformation from an ICC profile to sRGB.
+ *
+ * The output format is always word-ordered ARGB.
+ *
+ * @param[in] input_icc_blob Pointer to ICC profile blob representing the input profile.
+ * @param[in] icc_blob_size Number of bytes in the profile referenced by @p input_icc_blob.
+ * @param[in] input_format lcms description of the input pixels.
+ * @param[in] intent Rendering intent.
+ * @param[out] ctx_out Receives the lcms context that owns the transformation.  The caller must delete it
+ *                     after deleting the transformation.
+ *
+ * @return The transformation, or @c NULL on failure.
+ */
+static cmsHTRANSFORM create_srgb_transform(const uint8_t *input_icc_blob, size_t icc_blob_size,
+                                           cmsUInt32Number input_format, cmsUInt32Number intent, cmsContext *ctx_out)
+{
+    cmsHTRANSFORM retval = NULL;
+    cmsHPROFILE source_icc = NULL;
+    cmsHPROFILE srgb_icc = NULL;
+    cmsContext ctx = NULL;
+    //cmsToneCurve* srgb_tonecurve = NULL;
+#ifdef IMLIB2JXL_DEBUG
+    char *src_icc_name = NULL;
+    char *dst_icc_name = NULL;
+#endif
+    
+    if(!(ctx = cmsCreateContext(NULL, NULL)))
+        RETURN_ERR(NULL, "Failed to create lcms context");
+
+    if(!(source_icc = cmsOpenProfileFromMemTHR(ctx, input_icc_blob, icc_blob_size)))
+        RETURN_ERR(NULL, "Failed to create color profile from %zu B ICC data", icc_blob_size);
+
+    if(!(srgb_icc = cmsCreate_sRGBProfileTHR(ctx)))
+        RETURN_ERR(NULL, "Failed to create sRGB color profile");
+    
+    //if(is_gray)
+    //{
+    //    // No convenient function for creating a gray sRGB profile, so have to build it.
+    //    static const cmsCIExyY d65 = {0.3127, 0.3291, 1.0};
+    //    static const cmsFloat64Number srgbCurveParams[] = {2.4, 1.0 / 1.055, 0.055 / 1.055, 1.0 / 12.92, 0.04045};
+    //    if(!(srgb_tonecurve =  cmsBuildParametricToneCurve(ctx, 4/*sRGB*/, srgbCurveParams)))
+    //        RETURN_ERR(-1, "Failed to create sRGB tone curve");
+    //    if(!(srgb_icc = cmsCreateGrayProfileTHR(ctx, &d65, srgb_tonecurve)))
+    //        RETURN_ERR(-1, "Failed to create sRGB color profile");
+    //    input_format = TYPE_GRAYA_8;
+    //}
+
+#ifdef IMLIB2JXL_DEBUG
+    if((src_icc_name = get_icc_description(source_icc)) &&
+       (dst_icc_name = get_icc_description(srgb_icc)))
+    {
+        DEBUG_PRINTF("Creating color transformation [%s] -> [%s]; input_format=0x%x intent=%u",
+                     src_icc_name, dst_icc_name, (unsigned)input_format, (unsigned)intent);
+    }
+#endif
+
+    // Input and output are both 4 bytes per pixel, so lcms can work in place.
+    // Without cmsFLAGS_COPY_ALPHA, the alpha byte of the output is never written, so it keeps its value.
+
+    if(!(retval = cmsCreateTransformTHR(ctx, source_icc, input_format, srgb_icc,
+                                        IS_BIG_ENDIAN() ? TYPE_ARGB_8 : TYPE_BGRA_8,
+                                        intent, 0)))
+    {
+#ifdef IMLIB2JXL_DEBUG
+        char *from = get_icc_description(source_icc);
+        char *to = get_icc_description(srgb_icc);
+        DEBUG_PRINTF("Failed to create color transformation [%s] -> [%s]", from, to);
+        free(from);
+        free(to);
+#endif
+        goto ret;
+    }
+
+ret:
+    if(srgb_icc)
+        cmsCloseProfile(srgb_icc);
+    if(source_icc)
+        cmsCloseProfile(source_icc);
+    //if(srgb_tonecurve)
+    //    cmsFreeToneCurve(srgb_tonecurve);
+    if(retval)
+        *ctx_out = ctx;
+    else if(ctx)
+        cmsDeleteContext(ctx);
+#ifdef IMLIB2JXL_DEBUG
+    free(src_icc_name);
+    free(dst_icc_name);
+#endif
+    return retval;
+}
+
+
+/**
+ * Default number of color transformations kept by the transform cache.
+ * Override with IMLIB2_JXL_TRANSFORM_CACHE in the environment; 0 disables the cache.
+ */
+#define TRANSFORM_CACHE_DEFAULT_CAPACITY 8
+
+/**
+ * A color transformation to sRGB, ready for use, and the key it was created from.
+ */
+typedef struct transform_cache_entry
+{
+    struct transform_cache_entry *prev, *next; ///< Neighbours in the cache, most recently used first
+    uint64_t hash;                  ///< Hash of the rest of the key
+    uint8_t *icc_blob;              ///< Copy of the input ICC profile
+    size_t icc_size;
+    cmsUInt32Number input_format;
+    cmsUInt32Number intent;
+    cmsContext ctx;
+    cmsHTRANSFORM trans;
+    unsigned refs;                  ///< Number of users, plus one while the entry is in the cache
+} transform_cache_entry;
+
+/**
+ * Process-wide LRU cache of color transformations, so images sharing a profile don't each pay for
+ * lcms to build and optimize the same pipeline.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    transform_cache_entry *head, *tail;
+    unsigned count;
+    unsigned capacity;
+} transform_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+
+static void transform_cache_atfork_prepare(void)
+{
+    pthread_mutex_lock(&transform_cache.lock);
+}
+
+static void transform_cache_atfork_parent(void)
+{
+    pthread_mutex_unlock(&transform_cache.lock);
+}
+
+static void transform_cache_init(void)
+{
+    transform_cache.capacity = TRANSFORM_CACHE_DEFAULT_CAPACITY;
+    const char *env = getenv("IMLIB2_JXL_TRANSFORM_CACHE");
+    if(env)
+        transform_cache.capacity = strtoul(env, NULL, 10);
+
+    if(pthread_atfork(transform_cache_atfork_prepare, transform_cache_atfork_parent, transform_cache_atfork_parent) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+static void transform_cache_entry_free(transform_cache_entry *entry)
+{
+    cmsDeleteTransform(entry->trans);
+    cmsDeleteContext(entry->ctx);
+    free(entry->icc_blob);
+    free(entry);
+}
+
+/** Remove @p entry from the list.  The cache must be locked. */
+static void transform_cache_unlink(transform_cache_entry *entry)
+{
+    if(entry->prev)
+        entry->prev->next = entry->next;
+    else
+        transform_cache.head = entry->next;
+    if(entry->next)
+        entry->next->prev = entry->prev;
+    else
+        transform_cache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    --transform_cache.count;
+}
+
+/** Add @p entry to the front of the list.  The cache must be locked. */
+static void transform_cache_push_front(transform_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = transform_cache.head;
+    if(transform_cache.head)
+        transform_cache.head->prev = entry;
+    else
+        transform_cache.tail = entry;
+    transform_cache.head = entry;
+    ++transform_cache.count;
+}
+
+/** Find a matching entry.  The cache must be locked. */
+static transform_cache_entry *transform_cache_find(uint64_t hash, const uint8_t *icc_blob, size_t icc_size,
+                                                   cmsUInt32Number input_format, cmsUInt32Number intent)
+{
+    for(transform_cache_entry *entry = transform_cache.head; entry; entry = entry->next)
+    {
+        if(entry->hash == hash && entry->icc_size == icc_size && entry->input_format == input_format &&
+           entry->intent == intent && !memcmp(entry->icc_blob, icc_blob, icc_size))
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Release all cached transformations when the loader is unloaded.
+ */
+__attribute__((destructor))
+static void transform_cache_cleanup(void)
+{
+    pthread_mutex_lock(&transform_cache.lock);
+    while(transform_cache.tail)
+    {
+        transform_cache_entry *entry = transform_cache.tail;
+        transform_cache_unlink(entry);
+        if(--entry->refs == 0)
+            transform_cache_entry_free(entry);
+    }
+    pthread_mutex_unlock(&transform_cache.lock);
+}
+
+/**
+ * @brief Get a transformation from an ICC profile to sRGB, from the cache if possible.
+ *
+ * Release it with transform_cache_release() when finished.  The transformation may be used by
+ * several threads at once.
+ *
+ * @return Cache entry holding the transformation, or @c NULL on failure.
+ */
+static transform_cache_entry *transform_cache_acquire(const uint8_t *icc_blob, size_t icc_size,
+                                                      cmsUInt32Number input_format)
+{
+    pthread_once(&transform_cache.once, transform_cache_init);
+
+    // Rendering intent is a big-endian uint32 at offset 64 in the ICC header.  This is what
+    // cmsGetHeaderRenderingIntent() would return, without having to parse the profile.
+    cmsUInt32Number intent = INTENT_PERCEPTUAL;
+    if(icc_size >= 68)
+        intent = (cmsUInt32Number)icc_blob[64] << 24 | (cmsUInt32Number)icc_blob[65] << 16 |
+                 (cmsUInt32Number)icc_blob[66] << 8 | icc_blob[67];
+
+    uint64_t hash = hash_bytes(HASH_INIT, icc_blob, icc_size);
+    hash = hash_bytes(hash, &input_format, sizeof(input_format));
+    hash = hash_bytes(hash, &intent, sizeof(intent));
+
+    transform_cache_entry *retval = NULL;
+    transform_cache_entry *entry = NULL;
+
+    pthread_mutex_lock(&transform_cache.lock);
+    if((retval = transform_cache_find(hash, icc_blob, icc_size, input_format, intent)))
+    {
+        transform_cache_unlink(retval);
+        transform_cache_push_front(retval);
+        ++retval->refs;
+    }
+    pthread_mutex_unlock(&transform_cache.lock);
+
+    if(retval)
+    {
+        STATS_INC(transform_cache_hits);
+        DEBUG_PRINTF("Reusing cached color transformation");
+        goto ret;
+    }
+
+    STATS_INC(transform_cache_misses);
+
+    // Build the transformation without holding the lock, since this is the slow part.
+    if(!(entry = calloc(1, sizeof(*entry))) || !(entry->icc_blob = malloc(icc_size)))
+        RETURN_ERR(NULL, "Failed to allocate transform cache entry for %zu B ICC profile", icc_size);
+
+    memcpy(entry->icc_blob, icc_blob, icc_size);
+    entry->icc_size = icc_size;
+    entry->hash = hash;
+    entry->input_format = input_format;
+    entry->intent = intent;
+    entry->refs = 1;
+
+    if(!(entry->trans = create_srgb_transform(icc_blob, icc_size, input_format, intent, &entry->ctx)))
+        goto ret;
+
+    pthread_mutex_lock(&transform_cache.lock);
+    if(transform_cache.capacity > 0)
+    {
+        // Another thread may have built the same transformation meanwhile, in which case this one
+        // stays out of the cache and is freed on release.
+        if(!transform_cache_find(hash, icc_blob, icc_size, input_format, intent))
+        {
+            transform_cache_push_front(entry);
+            ++entry->refs;
+
+            while(transform_cache.count > transform_cache.capacity)
+            {
+                transform_cache_entry *oldest = transform_cache.tail;
+                transform_cache_unlink(oldest);
+                if(--oldest->refs == 0)
+                    transform_cache_entry_free(oldest);
+            }
+        }
+    }
+    pthread_mutex_unlock(&transform_cache.lock);
+
+    retval = entry;
+    entry = NULL;
+
+ret:
+    if(entry)
+    {
+        free(entry->icc_blob);
+        free(entry);
+    }
+    return retval;
+}
+
+/**
+ * @brief Give back a transformation obtained from transform_cache_acquire().
+ */
+static void transform_cache_release(transform_cache_entry *entry)
+{
+    pthread_mutex_lock(&transform_cache.lock);
+    const bool unused = (--entry->refs == 0);
+    pthread_mutex_unlock(&transform_cache.lock);
+
+    if(unused)
+        transform_cache_entry_free(entry);
+}
+
+
+/**
+ * Images with fewer pixels than this are color-converted in a single call on the calling thread,
+ * since handing them to worker threads would cost more than it saves.
+ */
+#define COLOR_TRANSFORM_PARALLEL_MIN_PIXELS (256*256)
+
+/**
+ * Approximate number of pixels in each stripe when color conversion is spread across threads.
+ */
+#define COLOR_TRANSFORM_STRIPE_PIXELS (64*1024)
+
+/**
+ * A color transformation split into stripes of whole rows.
+ */
+typedef struct
+{
+    cmsHTRANSFORM trans;
+    uint32_t *pixels;
+    size_t width;
+    size_t height;
+    size_t stripe_rows;     ///< Height of each stripe (except perhaps the last)
+} striped_transform;
+
+static JxlParallelRetCode striped_transform_init(void *opaque, size_t num_threads)
+{
+    (void)opaque;
+    (void)num_threads;
+    return 0;
+}
+
+static void striped_transform_run(void *opaque, uint32_t stripe, size_t thread_id)
+{
+    (void)thread_id;
+    const striped_transform *job = opaque;
+    const size_t y = stripe * job->stripe_rows;
+    const size_t rows = (job->height - y < job->stripe_rows) ? job->height - y : job->stripe_rows;
+    uint32_t *start = job->pixels + y * job->width;
+    const cmsUInt32Number stride = job->width * sizeof(uint32_t);
+
+    cmsDoTransformLineStride(job->trans, start, start, job->width, rows, stride, stride, 0, 0);
+}
+
+
+/**
+ * @brief Convert pixels to sRGB from whatever profile they're currently using.
+ *
+ * The pixels are transformed in place.  They are always word-ordered ARGB, 4 bytes per pixel, as expected
+ * by imlib2, but the color channels are interpreted according to @p num_channels:
+ * - num_channels == 1 : Gray, replicated in R, G and B
+ * - num_channels == 2 : Gray + Alpha, gray replicated in R, G and B
+ * - num_channels == 3 : RGB
+ * - num_channels == 4 : RGB + Alpha
+ *
+ * The alpha channel is left untouched.
+ *
+ * If @p runner is given, large images are split into stripes of rows that are converted by its
+ * worker threads.
+ * 
+ * TODO: Transforming integer pixels will incur rounding errors, but would using a float buffer be worth the overhead?
+ * 
+ * @param[in] input_icc_blob Pointer to ICC profile blob representing the current profile.
+ * @param[in] icc_blob_size Number of bytes in the profile referenced by @p input_icc_blob.
+ * @param[in,out] pixels Pointer to the pixel data, with no padding between rows.
+ * @param[in] width,height Dimensions of the image in @p pixels.
+ * @param[in] runner Runner from runner_acquire() to use for the conversion, or @c NULL to use only the calling thread.
+ *
+ * @return 0 on success.
+ */
+static int convert_to_srgb(uint8_t *input_icc_blob, size_t icc_blob_size, uint32_t *pixels, size_t width, size_t height,
+                           int num_channels, void *runner)
+{
+    int retval = -1;
+    transform_cache_entry *transform = NULL;
+    const size_t num_pixels = width * height;
+
+    // Gray pixels are read from a single byte of each ARGB word (B on little-endian, which comes first;
+    // B on big-endian, which comes last), and the other three bytes are skipped.
+    cmsUInt32Number input_format;
+    switch(num_channels)
+    {
+        case 3:
+        case 4: input_format = IS_BIG_ENDIAN() ? TYPE_ARGB_8 : TYPE_BGRA_8; break;
+        case 1:
+        case 2: input_format = COLORSPACE_SH(PT_GRAY)|CHANNELS_SH(1)|EXTRA_SH(3)|BYTES_SH(1)|DOSWAP_SH(IS_BIG_ENDIAN()); break;
+        default:
+            RETURN_ERR(-1, "Unsupported number of channels (%d)", num_channels);
+    }
+
+    if(!(transform = transform_cache_acquire(input_icc_blob, icc_blob_size, input_format)))
+        goto ret;
+
+    if(runner && num_pixels >= COLOR_TRANSFORM_PARALLEL_MIN_PIXELS)
+    {
+        striped_transform job = {
+            .trans = transform->trans,
+            .pixels = pixels,
+            .width = width,
+            .height = height,
+            .stripe_rows = (width >= COLOR_TRANSFORM_STRIPE_PIXELS) ? 1 : COLOR_TRANSFORM_STRIPE_PIXELS / width
+        };
+        const uint32_t num_stripes = (height + job.stripe_rows - 1) / job.stripe_rows;
+
+        DEBUG_PRINTF("Converting color space; %zux%zu pixels in %" PRIu32 " stripes, num_channels=%d",
+                     width, height, num_stripes, num_channels);
+
+        if(pool_run(runner, &job, striped_transform_init, striped_transform_run, 0, num_stripes) != 0)
+            RETURN_ERR(-1, "Failed to run color transformation on worker threads");
+    }
+    else
+    {
+        DEBUG_PRINTF("Converting color space; num_pixels=%zu num_channels=%d", num_pixels, num_channels);
+        cmsDoTransform(transform->trans, pixels, pixels, num_pixels);
+    }
+    retval = 0;
+
+ret:
+    if(transform)
+        transform_cache_release(transform);
+    return retval;
+}
+
+
+/**
+ * Return true if vectors are "roughly" equal.
+ * i.e. no component differs by >= 2e-5.
+ * This threshold is completely arbitrary.
+ *
+ * @param[in] length Dimension of both vectors.
+ * @param[in] v1,v2 Arrays of length @p length to compare.
+ */
+static bool near_equal(unsigned length, const double *v1, const double *v2)
+{
+  for(unsigned i=0; i<length; ++i)
+  {
+      if(fabs(v1[i]-v2[i]) >= .00002)
+          return false;
+  }
+  return true;
+}
+
+
+/**
+ * @brief Handle the JXL_DEC_COLOR_ENCODING event.
+ *
+ * Asks libjxl for sRGB output, and if it can't promise that, gets the ICC profile the pixels will be in.
+ *
+ * @param[in] dec Decoder that has just returned JXL_DEC_COLOR_ENCODING.
+ * @param[in] is_gray Whether the image is grayscale.
+ * @param[out] icc_blob Receives a pointer to the ICC profile, which the caller must free, or is left
+ *                      untouched if the pixels will already be sRGB.
+ * @param[out] icc_size Receives the size of the ICC profile.
+ *
+ * @return 0 on success, or -1 if out of memory.
+ */
+static int get_color_profile(JxlDecoder *dec, bool is_gray, uint8_t **icc_blob, size_t *icc_size)
+{
+    int retval = -1;
+
+    //if(is_gray)
+    //{
+    //    /* Converting color profiles for grayscale input is currently broken, so skip for now. */
+    //    DEBUG_PRINTF("Ignored color encoding for grayscale image");
+    //    return 0;
+    //}
+
+    // If the decoder can produce srgb, it should.
+    //JxlDecoderSetCms(); // not implemented in libjxl yet
+    JxlColorEncoding srgb;
+    JxlColorEncodingSetToSRGB(&srgb, is_gray);
+    if(JxlDecoderSetPreferredColorProfile(dec, &srgb) != JXL_DEC_SUCCESS)
+        WARN_PRINTF("Cannot set preferred output color profile");
+
+    /* If libjxl claims the decoded pixels will be RGB/sRGB, don't bother converting anything.
+     * If there's no JPEG-XL-encoded profile, or it's something other than sRGB, try to
+     * extract an ICC profile and save it for later. */
+
+    JxlColorEncoding color_enc;
+    if(IMLIB2_JXL_GET_ENCODED_PROFILE(dec, JXL_COLOR_PROFILE_TARGET_DATA, &color_enc) == JXL_DEC_SUCCESS)
+    {
+
+        if((color_enc.color_space == JXL_COLOR_SPACE_RGB || color_enc.color_space == JXL_COLOR_SPACE_GRAY)
+           &&
+           /* Transfer function is IEC sRGB */
+           color_enc.transfer_function == JXL_TRANSFER_FUNCTION_SRGB
+           &&
+           (color_enc.color_space == JXL_COLOR_SPACE_GRAY ||
+             (
+               /* Primaries are CIE sRGB or close enough */
+               color_enc.primaries == JXL_PRIMARIES_SRGB ||
+               (color_enc.primaries == JXL_PRIMARIES_CUSTOM &&
+                 near_equal(2, color_enc.primaries_red_xy, srgb.primaries_red_xy) &&
+                 near_equal(2, color_enc.primaries_green_xy, srgb.primaries_green_xy) &&
+                 near_equal(2, color_enc.primaries_blue_xy, srgb.primaries_blue_xy)
+               )
+             )
+           )
+           &&
+           (
+            /* White point is, or could pass for, D65 */
+             color_enc.white_point == JXL_WHITE_POINT_D65 ||
+            (color_enc.white_point == JXL_WHITE_POINT_CUSTOM && near_equal(2, color_enc.white_point_xy, srgb.white_point_xy))
+           )
+          )
+        {
+            DEBUG_PRINTF("Encoded color profile is %s %ssRGB/D65",
+                         color_enc.transfer_function == JXL_TRANSFER_FUNCTION_SRGB &&
+                         color_enc.white_point == JXL_WHITE_POINT_D65
+                         ? "exactly" : "nearly",
+                         color_enc.color_space == JXL_COLOR_SPACE_GRAY ? "(gray) " : "");
+            return 0;
+        }
+    }
+
+    size_t size;
+    if(IMLIB2_JXL_GET_ICC_PROFILE_SIZE(dec, JXL_COLOR_PROFILE_TARGET_DATA, &size) != JXL_DEC_SUCCESS)
+        return 0;
+
+    uint8_t *blob;
+    if(!(blob = malloc(size)))
+        RETURN_ERR(-1, "Failed to allocate %zu B for ICC profile", size);
+
+    if(IMLIB2_JXL_GET_ICC_PROFILE(dec, JXL_COLOR_PROFILE_TARGET_DATA, blob, size) != JXL_DEC_SUCCESS)
+    {
+        WARN_PRINTF("Failed to read ICC profile");
+        free(blob);
+        return 0;
+    }
+
+    DEBUG_PRINTF("Got ICC color profile");
+    *icc_blob = blob;
+    *icc_size = size;
+    return 0;
+
+ret:
+    return retval;
+}
+
+#endif // IMLIB2JXL_USE_LCMS
+
+
+/* Channel swizzling
+ *
+ * libjxl works with byte-ordered RGB(A) or Gray(A), while imlib2 wants word-ordered ARGB.
+ * Each conversion has a portable scalar version, and SIMD versions that are selected at
+ * runtime according to what the CPU supports, so builds don't depend on -march.
+ * All versions produce identical output.
+ */
+
+typedef void (*to_argb_func)(uint32_t *dst, const uint8_t *src, size_t num_pixels);
+typedef void (*from_argb_func)(uint8_t *dst, const uint32_t *src, size_t num_pixels);
+typedef unsigned (*scan_argb_func)(const uint32_t *src, size_t num_pixels);
+
+/** Flags returned by the scan functions */
+#define ARGB_OPAQUE 1u  ///< Every pixel has alpha 255
+#define ARGB_GRAY   2u  ///< Every pixel has R == G == B
+
+static void rgba_to_argb_c(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    for (size_t i=0; i<num_pixels; ++i)
+        dst[i] = PIXEL_ARGB((uint32_t)src[4*i+3], src[4*i+0], src[4*i+1], src[4*i+2]);
+}
+
+static void rgb_to_argb_c(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    for (size_t i=0; i<num_pixels; ++i)
+        dst[i] = PIXEL_ARGB(255u, src[3*i+0], src[3*i+1], src[3*i+2]);
+}
+
+static void graya_to_argb_c(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    for (size_t i=0; i<num_pixels; ++i)
+        dst[i] = PIXEL_ARGB((uint32_t)src[2*i+1], src[2*i], src[2*i], src[2*i]);
+}
+
+static void gray_to_argb_c(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    for (size_t i=0; i<num_pixels; ++i)
+        dst[i] = PIXEL_ARGB(255u, src[i], src[i], src[i]);
+}
+
+static void argb_to_rgb_c(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    for(size_t i=0; i<num_pixels; ++i)
+    {
+        const uint32_t pixel = src[i];
+        dst[i*3+0] = PIXEL_R(pixel);
+        dst[i*3+1] = PIXEL_G(pixel);
+        dst[i*3+2] = PIXEL_B(pixel);
+    }
+}
+
+static void argb_to_rgba_c(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    for(size_t i=0; i<num_pixels; ++i)
+    {
+        const uint32_t pixel = src[i];
+        dst[i*4+0] = PIXEL_R(pixel);
+        dst[i*4+1] = PIXEL_G(pixel);
+        dst[i*4+2] = PIXEL_B(pixel);
+        dst[i*4+3] = PIXEL_A(pixel);
+    }
+}
+
+static void argb_to_gray_c(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    for(size_t i=0; i<num_pixels; ++i)
+        dst[i] = PIXEL_G(src[i]);
+}
+
+static void argb_to_graya_c(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    for(size_t i=0; i<num_pixels; ++i)
+    {
+        const uint32_t pixel = src[i];
+        dst[i*2+0] = PIXEL_G(pixel);
+        dst[i*2+1] = PIXEL_A(pixel);
+    }
+}
+
+/* The scan functions check which of the ARGB_* properties hold for all of @p src. */
+
+static unsigned scan_argb_c(const uint32_t *src, size_t num_pixels)
+{
+    uint32_t all = 0xFFFFFFFF;  // AND of every pixel - alpha stays 0xFF only if all are opaque
+    uint32_t diff = 0;          // OR of (B ^ G) and (G ^ R) - stays 0 only if all are gray
+    for(size_t i=0; i<num_pixels; ++i)
+    {
+        all &= src[i];
+        diff |= (src[i] ^ (src[i] >> 8)) & 0xFFFF;
+    }
+    return ((PIXEL_A(all) == 0xFF) ? ARGB_OPAQUE : 0) | ((diff == 0) ? ARGB_GRAY : 0);
+}
+
+
+#ifdef IMLIB2JXL_SIMD_X86
+/* x86 is always little-endian, so an ARGB word is stored as B,G,R,A in memory.
+ * Each kernel handles as many pixels as it can without reading or writing out of bounds,
+ * then leaves the rest to the scalar version. */
+
+/* SSE2 */
+
+/** Swap bytes 0 and 2 of every 32-bit lane - turns RGBA into BGRA and vice versa. */
+__attribute__((target("sse2")))
+static inline __m128i swap_rb_sse2(__m128i x)
+{
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i low = _mm_set1_epi32(0xFF);
+    return _mm_or_si128(_mm_and_si128(x, ga),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 16), low),
+                                     _mm_slli_epi32(_mm_and_si128(x, low), 16)));
+}
+
+__attribute__((target("sse2")))
+static void rgba_to_argb_sse2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i), swap_rb_sse2(_mm_loadu_si128((const __m128i*)(src + 4*i))));
+    rgba_to_argb_c(dst + i, src + 4*i, num_pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void graya_to_argb_sse2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m128i low = _mm_set1_epi16(0xFF);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+    {
+        const __m128i ga = _mm_loadu_si128((const __m128i*)(src + 2*i));
+        const __m128i g = _mm_and_si128(ga, low);
+        const __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(gg, ga));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(gg, ga));
+    }
+    graya_to_argb_c(dst + i, src + 2*i, num_pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void gray_to_argb_sse2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        const __m128i g = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+        const __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+        const __m128i ga_lo = _mm_unpacklo_epi8(g, opaque);
+        const __m128i ga_hi = _mm_unpackhi_epi8(g, opaque);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(gg_hi, ga_hi));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(gg_hi, ga_hi));
+    }
+    gray_to_argb_c(dst + i, src + i, num_pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void argb_to_rgba_sse2(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + 4*i), swap_rb_sse2(_mm_loadu_si128((const __m128i*)(src + i))));
+    argb_to_rgba_c(dst + 4*i, src + i, num_pixels - i);
+}
+
+__attribute__((target("sse2")))
+static unsigned scan_argb_sse2(const uint32_t *src, size_t num_pixels)
+{
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    __m128i all = _mm_set1_epi32(-1);
+    __m128i diff = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+    {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        all = _mm_and_si128(all, x);
+        diff = _mm_or_si128(diff, _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi32(x, 8)), low));
+    }
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    const unsigned flags = ((_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(all, alpha), alpha)) == 0xFFFF) ? ARGB_OPAQUE : 0) |
+                           ((_mm_movemask_epi8(_mm_cmpeq_epi32(diff, _mm_setzero_si128())) == 0xFFFF) ? ARGB_GRAY : 0);
+    return flags & scan_argb_c(src + i, num_pixels - i);
+}
+
+/* SSSE3 - pshufb makes the 3-byte layouts practical */
+
+__attribute__((target("ssse3")))
+static void rgba_to_argb_ssse3(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 4*i)), shuf));
+    rgba_to_argb_c(dst + i, src + 4*i, num_pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void rgb_to_argb_ssse3(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    // Each 16-byte load only uses 12 bytes, so stop while there are still 16 left to read.
+    for(; i + 6 <= num_pixels; i += 4)
+    {
+        const __m128i rgb = _mm_loadu_si128((const __m128i*)(src + 3*i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_shuffle_epi8(rgb, shuf), opaque));
+    }
+    rgb_to_argb_c(dst + i, src + 3*i, num_pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void graya_to_argb_ssse3(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m128i shuf_lo = _mm_setr_epi8(0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7);
+    const __m128i shuf_hi = _mm_setr_epi8(8,8,8,9, 10,10,10,11, 12,12,12,13, 14,14,14,15);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+    {
+        const __m128i ga = _mm_loadu_si128((const __m128i*)(src + 2*i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(ga, shuf_lo));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_shuffle_epi8(ga, shuf_hi));
+    }
+    graya_to_argb_c(dst + i, src + 2*i, num_pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void argb_to_rgb_ssse3(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+    size_t i = 0;
+    // Each 16-byte store only fills 12 bytes (the rest is overwritten by the next one),
+    // so stop while there are still 16 bytes of room.
+    for(; i + 6 <= num_pixels; i += 4)
+    {
+        const __m128i argb = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + 3*i), _mm_shuffle_epi8(argb, shuf));
+    }
+    argb_to_rgb_c(dst + 3*i, src + i, num_pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void argb_to_rgba_ssse3(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    const __m128i shuf = _mm_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + 4*i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), shuf));
+    argb_to_rgba_c(dst + 4*i, src + i, num_pixels - i);
+}
+
+/* AVX2 - vpshufb works within each 128-bit half, so the shuffles are the SSSE3 ones twice over */
+
+__attribute__((target("avx2")))
+static void rgba_to_argb_avx2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15,
+                                          2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + 4*i)), shuf));
+    rgba_to_argb_c(dst + i, src + 4*i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb_to_argb_avx2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1,
+                                          2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    // Pixels i..i+3 and i+4..i+7 are loaded into separate halves, 16 bytes each.
+    for(; i + 10 <= num_pixels; i += 8)
+    {
+        const __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + 3*i))),
+                                                    _mm_loadu_si128((const __m128i*)(src + 3*i + 12)), 1);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_shuffle_epi8(rgb, shuf), opaque));
+    }
+    rgb_to_argb_c(dst + i, src + 3*i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void graya_to_argb_avx2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i alpha = _mm256_set1_epi32(0xFF00);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+    {
+        const __m256i ga = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + 2*i)));
+        const __m256i g = _mm256_and_si256(ga, low);
+        const __m256i ggg = _mm256_or_si256(g, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(g, 16)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(ggg, _mm256_slli_epi32(_mm256_and_si256(ga, alpha), 16)));
+    }
+    graya_to_argb_c(dst + i, src + 2*i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void gray_to_argb_avx2(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+    {
+        const __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        const __m256i ggg = _mm256_or_si256(g, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(g, 16)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(ggg, opaque));
+    }
+    gray_to_argb_c(dst + i, src + i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void argb_to_rgb_avx2(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+                                          2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+    size_t i = 0;
+    // Each half is stored separately; the upper half overwrites the unused tail of the lower one.
+    for(; i + 10 <= num_pixels; i += 8)
+    {
+        const __m256i rgb = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), shuf);
+        _mm_storeu_si128((__m128i*)(dst + 3*i), _mm256_castsi256_si128(rgb));
+        _mm_storeu_si128((__m128i*)(dst + 3*i + 12), _mm256_extracti128_si256(rgb, 1));
+    }
+    argb_to_rgb_c(dst + 3*i, src + i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void argb_to_rgba_avx2(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    const __m256i shuf = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15,
+                                          2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+        _mm256_storeu_si256((__m256i*)(dst + 4*i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), shuf));
+    argb_to_rgba_c(dst + 4*i, src + i, num_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned scan_argb_avx2(const uint32_t *src, size_t num_pixels)
+{
+    const __m256i low = _mm256_set1_epi32(0xFFFF);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    __m256i all = _mm256_set1_epi32(-1);
+    __m256i diff = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 8 <= num_pixels; i += 8)
+    {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        all = _mm256_and_si256(all, x);
+        diff = _mm256_or_si256(diff, _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi32(x, 8)), low));
+    }
+    const unsigned flags = ((_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(all, alpha), alpha)) == -1) ? ARGB_OPAQUE : 0) |
+                           ((_mm256_movemask_epi8(_mm256_cmpeq_epi32(diff, _mm256_setzero_si256())) == -1) ? ARGB_GRAY : 0);
+    return flags & scan_argb_c(src + i, num_pixels - i);
+}
+#endif // IMLIB2JXL_SIMD_X86
+
+
+#ifdef IMLIB2JXL_SIMD_NEON
+/* NEON is always available on the targets that define __ARM_NEON, so there's nothing to detect.
+ * The structured loads and stores do the (de)interleaving. */
+
+static void rgba_to_argb_neon(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        uint8x16x4_t px = vld4q_u8(src + 4*i);
+        const uint8x16_t r = px.val[0];
+        px.val[0] = px.val[2];
+        px.val[2] = r;
+        vst4q_u8((uint8_t*)(dst + i), px);
+    }
+    rgba_to_argb_c(dst + i, src + 4*i, num_pixels - i);
+}
+
+static void rgb_to_argb_neon(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        const uint8x16x3_t rgb = vld3q_u8(src + 3*i);
+        const uint8x16x4_t px = {{ rgb.val[2], rgb.val[1], rgb.val[0], vdupq_n_u8(0xFF) }};
+        vst4q_u8((uint8_t*)(dst + i), px);
+    }
+    rgb_to_argb_c(dst + i, src + 3*i, num_pixels - i);
+}
+
+static void graya_to_argb_neon(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        const uint8x16x2_t ga = vld2q_u8(src + 2*i);
+        const uint8x16x4_t px = {{ ga.val[0], ga.val[0], ga.val[0], ga.val[1] }};
+        vst4q_u8((uint8_t*)(dst + i), px);
+    }
+    graya_to_argb_c(dst + i, src + 2*i, num_pixels - i);
+}
+
+static void gray_to_argb_neon(uint32_t *dst, const uint8_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        const uint8x16_t g = vld1q_u8(src + i);
+        const uint8x16x4_t px = {{ g, g, g, vdupq_n_u8(0xFF) }};
+        vst4q_u8((uint8_t*)(dst + i), px);
+    }
+    gray_to_argb_c(dst + i, src + i, num_pixels - i);
+}
+
+static void argb_to_rgb_neon(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        const uint8x16x4_t px = vld4q_u8((const uint8_t*)(src + i));
+        const uint8x16x3_t rgb = {{ px.val[2], px.val[1], px.val[0] }};
+        vst3q_u8(dst + 3*i, rgb);
+    }
+    argb_to_rgb_c(dst + 3*i, src + i, num_pixels - i);
+}
+
+static void argb_to_rgba_neon(uint8_t *dst, const uint32_t *src, size_t num_pixels)
+{
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16)
+    {
+        uint8x16x4_t px = vld4q_u8((const uint8_t*)(src + i));
+        const uint8x16_t b = px.val[0];
+        px.val[0] = px.val[2];
+        px.val[2] = b;
+        vst4q_u8(dst + 4*i, px);
+    }
+    argb_to_rgba_c(dst + 4*i, src + i, num_pixels - i);
+}
+
+static unsigned scan_argb_neon(const uint32_t *src, size_t num_pixels)
+{
+    const uint32x4_t low = vdupq_n_u32(0xFFFF);
+    uint32x4_t all = vdupq_n_u32(0xFFFFFFFF);
+    uint32x4_t diff = vdupq_n_u32(0);
+    size_t i = 0;
+    for(; i + 4 <= num_pixels; i += 4)
+    {
+        const uint32x4_t x = vld1q_u32(src + i);
+        all = vandq_u32(all, x);
+        diff = vorrq_u32(diff, vandq_u32(veorq_u32(x, vshrq_n_u32(x, 8)), low));
+    }
+    uint32_t all_lanes[4], diff_lanes[4];
+    vst1q_u32(all_lanes, all);
+    vst1q_u32(diff_lanes, diff);
+    const uint32_t all_word = all_lanes[0] & all_lanes[1] & all_lanes[2] & all_lanes[3];
+    const uint32_t diff_word = diff_lanes[0] | diff_lanes[1] | diff_lanes[2] | diff_lanes[3];
+    const unsigned flags = ((PIXEL_A(all_word) == 0xFF) ? ARGB_OPAQUE : 0) | ((diff_word == 0) ? ARGB_GRAY : 0);
+    return flags & scan_argb_c(src + i, num_pixels - i);
+}
+#endif // IMLIB2JXL_SIMD_NEON
+
+
+/**
+ * Conversion functions in use, indexed by number of channels - 1.
+ * Entries are @c NULL for layouts that aren't needed.
+ */
+static struct
+{
+    pthread_once_t once;
+    to_argb_func to_argb[4];
+    from_argb_func from_argb[4];
+    scan_argb_func scan;
+} swizzle = {
+    .once = PTHREAD_ONCE_INIT,
+    .to_argb = { gray_to_argb_c, graya_to_argb_c, rgb_to_argb_c, rgba_to_argb_c },
+    .from_argb = { argb_to_gray_c, argb_to_graya_c, argb_to_rgb_c, argb_to_rgba_c },
+    .scan = scan_argb_c
+};
+
+/**
+ * Pick the fastest conversion functions for this CPU.
+ *
+ * Setting IMLIB2_JXL_SIMD in the environment to "none", "sse2", "ssse3" or "avx2" limits the
+ * choice, which is mainly useful for comparing the implementations.
+ */
+static void swizzle_init(void)
+{
+    const char *limit = getenv("IMLIB2_JXL_SIMD");
+    if(limit && !strcmp(limit, "none"))
+    {
+        DEBUG_PRINTF("Using scalar channel swizzling");
+        return;
+    }
+#if defined(IMLIB2JXL_SIMD_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+    {
+        DEBUG_PRINTF("Using SSE2 channel swizzling");
+        swizzle.to_argb[0] = gray_to_argb_sse2;
+        swizzle.to_argb[1] = graya_to_argb_sse2;
+        swizzle.to_argb[3] = rgba_to_argb_sse2;
+        swizzle.from_argb[3] = argb_to_rgba_sse2;
+        swizzle.scan = scan_argb_sse2;
+    }
+    if(limit && !strcmp(limit, "sse2"))
+        return;
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        DEBUG_PRINTF("Using SSSE3 channel swizzling");
+        swizzle.to_argb[1] = graya_to_argb_ssse3;
+        swizzle.to_argb[2] = rgb_to_argb_ssse3;
+        swizzle.to_argb[3] = rgba_to_argb_ssse3;
+        swizzle.from_argb[2] = argb_to_rgb_ssse3;
+        swizzle.from_argb[3] = argb_to_rgba_ssse3;
+    }
+    if(limit && !strcmp(limit, "ssse3"))
+        return;
+    if(__builtin_cpu_supports("avx2"))
+    {
+        DEBUG_PRINTF("Using AVX2 channel swizzling");
+        swizzle.to_argb[0] = gray_to_argb_avx2;
+        swizzle.to_argb[1] = graya_to_argb_avx2;
+        swizzle.to_argb[2] = rgb_to_argb_avx2;
+        swizzle.to_argb[3] = rgba_to_argb_avx2;
+        swizzle.from_argb[2] = argb_to_rgb_avx2;
+        swizzle.from_argb[3] = argb_to_rgba_avx2;
+        swizzle.scan = scan_argb_avx2;
+    }
+#elif defined(IMLIB2JXL_SIMD_NEON)
+    DEBUG_PRINTF("Using NEON channel swizzling");
+    swizzle.to_argb[0] = gray_to_argb_neon;
+    swizzle.to_argb[1] = graya_to_argb_neon;
+    swizzle.to_argb[2] = rgb_to_argb_neon;
+    swizzle.to_argb[3] = rgba_to_argb_neon;
+    swizzle.from_argb[2] = argb_to_rgb_neon;
+    swizzle.from_argb[3] = argb_to_rgba_neon;
+    swizzle.scan = scan_argb_neon;
+#endif
+}
+
+/**
+ * @brief Convert a run of byte-ordered pixels from libjxl to word-ordered ARGB.
+ *
+ * The channels in @p src are in a fixed order, indicated by @p num_channels:
+ * - num_channels == 1 : Gray
+ * - num_channels == 2 : Gray + Alpha
+ * - num_channels == 3 : RGB
+ * - num_channels == 4 : RGB + Alpha
+ *
+ * @param[out] dst Pointer to where the ARGB pixels will be written.
+ * @param[in] src Pointer to the pixels from libjxl.
+ * @param[in] num_pixels Number of pixels to convert.
+ * @param[in] num_channels Number of channels in @p src.
+ */
+static void swizzle_to_argb(uint32_t *dst, const uint8_t *src, size_t num_pixels, int num_channels)
+{
+    pthread_once(&swizzle.once, swizzle_init);
+    swizzle.to_argb[num_channels - 1](dst, src, num_pixels);
+}
+
+/**
+ * @brief Convert a run of word-ordered ARGB pixels from imlib2 to byte-ordered pixels for libjxl.
+ *
+ * The layouts are the same as for swizzle_to_argb().  For Gray and Gray + Alpha, the green channel
+ * is taken as the gray level.
+ *
+ * @param[out] dst Pointer to where the pixels will be written.
+ * @param[in] src Pointer to the ARGB pixels.
+ * @param[in] num_pixels Number of pixels to convert.
+ * @param[in] num_channels Number of channels to write to @p dst.
+ */
+static void swizzle_from_argb(uint8_t *dst, const uint32_t *src, size_t num_pixels, int num_channels)
+{
+    pthread_once(&swizzle.once, swizzle_init);
+    swizzle.from_argb[num_channels - 1](dst, src, num_pixels);
+}
+
+/**
+ * Number of pixels scanned between checks for whether the scan can stop early.
+ */
+#define SCAN_BLOCK_PIXELS 16384
+
+/**
+ * @brief Find out whether a run of ARGB pixels is fully opaque and/or gray.
+ *
+ * Stops as soon as none of the properties can hold, so colorful images are rejected quickly.
+ *
+ * @param[in] src Pointer to the ARGB pixels.
+ * @param[in] num_pixels Number of pixels to check.
+ * @param[in] wanted ARGB_* flags to check for.
+ *
+ * @return The subset of @p wanted that holds for every pixel.
+ */
+static unsigned scan_argb(const uint32_t *src, size_t num_pixels, unsigned wanted)
+{
+    pthread_once(&swizzle.once, swizzle_init);
+    unsigned flags = wanted;
+    for(size_t i = 0; flags && i < num_pixels; i += SCAN_BLOCK_PIXELS)
+    {
+        const size_t n = (num_pixels - i < SCAN_BLOCK_PIXELS) ? num_pixels - i : SCAN_BLOCK_PIXELS;
+        flags &= swizzle.scan(src + i, n);
+    }
+    return flags;
+}
+
+
+#ifdef FF_IMAGE_ANIMATED
+/**
+ * @brief Count the frames of an animation by walking their headers, without decoding any pixels.
+ *
+ * Only frames that would be displayed are counted: zero-duration frames that libjxl blends into the
+ * next one don't count separately.
+ *
+ * @param[in] input,input_size The whole JPEG XL file.
+ * @param[out] frame_count Receives the number of frames.
+ *
+ * @return 0 on success.
+ */
+static int count_frames(const uint8_t *input, size_t input_size, int *frame_count)
+{
+    int retval = -1;
+    int count = 0;
+    JxlDecoder *dec = NULL;
+    JxlDecoderStatus res;
+    const JxlMemoryManager memory_manager = mem_manager(NULL);
+
+    if(!(dec = JxlDecoderCreate(&memory_manager)))
+        RETURN_ERR(-1, "Failed in JxlDecoderCreate");
+    if(JxlDecoderSubscribeEvents(dec, JXL_DEC_FRAME) != JXL_DEC_SUCCESS)
+        RETURN_ERR(-1, "Failed in JxlDecoderSubscribeEvents");
+    if(JxlDecoderSetInput(dec, input, input_size) != JXL_DEC_SUCCESS)
+        RETURN_ERR(-1, "Failed in JxlDecoderSetInput");
+    JxlDecoderCloseInput(dec);
+
+    while((res = JxlDecoderProcessInput(dec)) == JXL_DEC_FRAME)
+    {
+        JxlFrameHeader frame_header;
+        if(JxlDecoderGetFrameHeader(dec, &frame_header) != JXL_DEC_SUCCESS)
+            RETURN_ERR(-1, "Failed in JxlDecoderGetFrameHeader");
+        if(++count == INT_MAX || frame_header.is_last)
+            break;
+    }
+    if(res != JXL_DEC_FRAME && res != JXL_DEC_SUCCESS)
+        RETURN_ERR(-1, "Error while reading frame headers: corrupted file?");
+
+    DEBUG_PRINTF("Animation has %d frames", count);
+    *frame_count = count;
+    retval = 0;
+
+ret:
+    if(dec)
+        JxlDecoderDestroy(dec);
+    return retval;
+}
+
+
+/**
+ * Number of files whose frame index is kept.  Viewers load an animation one frame at a time, so
+ * this saves counting the frames again for every one.
+ */
+#define FRAME_INDEX_CACHE_CAPACITY 4
+
+/**
+ * Number of bytes at each end of a file that are hashed to tell apart files with the same name and size.
+ */
+#define FILE_HASH_BYTES 4096
+
+/**
+ * What tells a file apart from a different one with the same name, without reading all of it.
+ */
+typedef struct
+{
+    size_t size;
+    uint64_t hash;              ///< Hash of the start and end of the file
+    dev_t dev;                  ///< Device and inode of the open file, or 0 if there isn't one
+    ino_t ino;
+    struct timespec mtime;      ///< When the open file was last modified, or 0
+} file_id;
+
+/**
+ * @brief Identify a file.
+ *
+ * A file rewritten in place keeps its inode, and may keep its size and both ends (an animation
+ * with a frame changed in the middle, say), so the modification time is part of the identity too.
+ *
+ * @param[in] fp The file imlib2 has open, if any.
+ * @param[in] input,input_size The whole file.
+ * @param[out] id Receives the identity.
+ */
+static void file_id_get(FILE *fp, const uint8_t *input, size_t input_size, file_id *id)
+{
+    struct stat st;
+
+    *id = (file_id){ .size = input_size };
+    id->hash = hash_bytes(HASH_INIT, input, (input_size < FILE_HASH_BYTES) ? input_size : FILE_HASH_BYTES);
+    if(input_size > FILE_HASH_BYTES)
+        id->hash = hash_bytes(id->hash, input + input_size - FILE_HASH_BYTES, FILE_HASH_BYTES);
+    if(fp && fstat(fileno(fp), &st) == 0)
+    {
+        id->dev = st.st_dev;
+        id->ino = st.st_ino;
+        id->mtime = st.st_mtim;
+    }
+}
+
+static bool file_id_equal(const file_id *a, const file_id *b)
+{
+    return a->size == b->size && a->hash == b->hash && a->dev == b->dev && a->ino == b->ino &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/**
+ * A frame from which decoding can start without any of the frames before it.
+ */
+typedef struct
+{
+    size_t frame;       ///< 0-based number of the frame
+    size_t offset;      ///< Position of the frame's first byte in the codestream
+} keyframe;
+
+/**
+ * What's known about the frames of one file.
+ */
+typedef struct frame_index
+{
+    struct frame_index *next;
+    char *name;
+    file_id id;
+    int frame_count;
+    size_t codestream_offset;   ///< Position of the codestream in the file
+    size_t codestream_size;     ///< Size of the codestream, or 0 if it isn't stored in one piece
+    size_t num_keyframes;
+    keyframe *keyframes;        ///< From the jxli box, in order of position.  The first is always frame 0.
+} frame_index;
+
+/**
+ * Recently used frame indexes, most recent first.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    frame_index *head;
+} frame_index_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+/**
+ * Where to start decoding to reach a particular frame.
+ */
+typedef struct
+{
+    const uint8_t *codestream;  ///< The file's codestream
+    size_t header_size;         ///< Bytes before the first frame, or 0 if decoding has to start at the beginning
+    size_t offset;              ///< Position of the keyframe to restart from
+    size_t frame;               ///< 0-based number of that keyframe
+    size_t size;                ///< Bytes from @c offset to the end of the codestream
+} frame_restart;
+
+static void frame_index_atfork_prepare(void)
+{
+    pthread_mutex_lock(&frame_index_cache.lock);
+}
+
+static void frame_index_atfork_parent(void)
+{
+    pthread_mutex_unlock(&frame_index_cache.lock);
+}
+
+static void frame_index_init(void)
+{
+    if(pthread_atfork(frame_index_atfork_prepare, frame_index_atfork_parent, frame_index_atfork_parent) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+static void frame_index_free(frame_index *index)
+{
+    if(!index)
+        return;
+    free(index->name);
+    free(index->keyframes);
+    free(index);
+}
+
+__attribute__((destructor))
+static void frame_index_cleanup(void)
+{
+    pthread_mutex_lock(&frame_index_cache.lock);
+    while(frame_index_cache.head)
+    {
+        frame_index *index = frame_index_cache.head;
+        frame_index_cache.head = index->next;
+        frame_index_free(index);
+    }
+    pthread_mutex_unlock(&frame_index_cache.lock);
+}
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Read a variable-length integer, as used in the jxli box.
+ *
+ * @return Number of bytes read, or 0 if the integer is truncated or too long.
+ */
+static size_t read_varint(const uint8_t *p, size_t size, uint64_t *value)
+{
+    uint64_t v = 0;
+    for(size_t i=0; i<size && i<10; ++i)
+    {
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if(!(p[i] & 0x80))
+        {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Locate the codestream and the jxli (frame index) box of a file.
+ *
+ * A container's codestream is only located if it's in a single jxlc box; if it's split into jxlp
+ * boxes, @c codestream_size is set to 0.
+ *
+ * @param[in] input,input_size The whole JPEG XL file.
+ * @param[in,out] index Receives the position of the codestream.
+ * @param[out] jxli,jxli_size Receive the contents of the jxli box, or @c NULL if there isn't one.
+ */
+static void find_codestream(const uint8_t *input, size_t input_size, frame_index *index,
+                            const uint8_t **jxli, size_t *jxli_size)
+{
+    index->codestream_offset = 0;
+    index->codestream_size = 0;
+    *jxli = NULL;
+    *jxli_size = 0;
+
+    if(JxlSignatureCheck(input, input_size) == JXL_SIG_CODESTREAM)
+    {
+        index->codestream_size = input_size;
+        return;
+    }
+
+    bool split = false;
+    size_t pos = 0;
+    while(input_size - pos >= 8)
+    {
+        uint64_t box_size = load_be32(input + pos);
+        size_t header_size = 8;
+        if(box_size == 1)
+        {
+            if(input_size - pos < 16)
+                break;
+            box_size = ((uint64_t)load_be32(input + pos + 8) << 32) | load_be32(input + pos + 12);
+            header_size = 16;
+        }
+        else if(box_size == 0)
+        {
+            box_size = input_size - pos; // Last box
+        }
+        if(box_size < header_size || box_size > input_size - pos)
+            break;
+
+        const uint8_t *type = input + pos + 4;
+        if(memcmp(type, "jxlc", 4) == 0)
+        {
+            index->codestream_offset = pos + header_size;
+            index->codestream_size = box_size - header_size;
+        }
+        else if(memcmp(type, "jxlp", 4) == 0)
+        {
+            split = true;
+        }
+        else if(memcmp(type, "jxli", 4) == 0)
+        {
+            *jxli = input + pos + header_size;
+            *jxli_size = box_size - header_size;
+        }
+        pos += box_size;
+    }
+
+    if(split)
+        index->codestream_size = 0;
+}
+
+/**
+ * @brief Read the keyframes listed in a jxli box.
+ *
+ * They're only kept if their offsets make sense for the codestream.  The first is always frame 0, so
+ * its offset should be where the headers end, but that's for the caller to check.
+ *
+ * @param[in] box,box_size Contents of the jxli box.
+ * @param[in,out] index Receives the keyframes.  Its codestream must already have been located.
+ */
+static void parse_frame_index_box(const uint8_t *box, size_t box_size, frame_index *index)
+{
+    uint64_t num_frames;
+    size_t pos = read_varint(box, box_size, &num_frames);
+
+    // Each entry takes at least 3 bytes
+    if(!pos || num_frames == 0 || num_frames > box_size / 3 || box_size - pos < 8)
+        return;
+    pos += 8; // TNUM and TDEN; the frame headers have the timing
+
+    keyframe *keyframes = malloc(num_frames * sizeof(*keyframes));
+    if(!keyframes)
+        return;
+
+    uint64_t frame = 0;
+    uint64_t offset = 0;
+    for(size_t i=0; i<num_frames; ++i)
+    {
+        // OFFi, Ti, Fi
+        uint64_t fields[3];
+        for(int f=0; f<3; ++f)
+        {
+            const size_t n = read_varint(box + pos, box_size - pos, &fields[f]);
+            if(!n)
+                goto bad;
+            pos += n;
+        }
+        const uint64_t offset_delta = fields[0];
+        const uint64_t frame_delta = fields[2];
+
+        // Offsets must increase (the first is after the headers) and stay inside the codestream
+        if(offset_delta == 0 || offset_delta >= index->codestream_size - offset)
+            goto bad;
+        offset += offset_delta;
+        keyframes[i].frame = frame;
+        keyframes[i].offset = offset;
+        frame += frame_delta;
+    }
+
+    DEBUG_PRINTF("Frame index box lists %zu keyframes", (size_t)num_frames);
+    index->keyframes = keyframes;
+    index->num_keyframes = num_frames;
+    return;
+
+bad:
+    DEBUG_PRINTF("Ignoring unusable frame index box");
+    free(keyframes);
+}
+
+/**
+ * @brief Check that a codestream's headers end exactly @p header_size bytes in.
+ *
+ * A decoder is given only the first @p header_size bytes.  If they're exactly the headers (with the
+ * preview frame, if any), it reads the basic info and color encoding, then asks for more input at the
+ * start of the first frame, having used every byte.  If they end too soon, it never gets to the color
+ * encoding; if they run into the first frame, it either reports the frame or leaves the start of it
+ * unused.
+ *
+ * @return true if the headers end at @p header_size.
+ */
+static bool check_header_size(const uint8_t *codestream, size_t header_size)
+{
+    bool ok = false;
+    bool have_color = false;
+    JxlDecoder *dec;
+    JxlDecoderStatus res;
+    const JxlMemoryManager memory_manager = mem_manager(NULL);
+
+    if(!(dec = JxlDecoderCreate(&memory_manager)))
+        return false;
+    if(JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME) == JXL_DEC_SUCCESS &&
+       JxlDecoderSetInput(dec, codestream, header_size) == JXL_DEC_SUCCESS)
+    {
+        while((res = JxlDecoderProcessInput(dec)) == JXL_DEC_BASIC_INFO || res == JXL_DEC_COLOR_ENCODING)
+        {
+            if(res == JXL_DEC_COLOR_ENCODING)
+                have_color = true;
+        }
+        ok = have_color && res == JXL_DEC_NEED_MORE_INPUT && JxlDecoderReleaseInput(dec) == 0;
+    }
+    JxlDecoderDestroy(dec);
+    return ok;
+}
+
+/**
+ * @brief Build the frame index of a file.
+ *
+ * @return The new index, or @c NULL on failure.
+ */
+static frame_index *frame_index_build(const char *name, const uint8_t *input, size_t input_size, const file_id *id)
+{
+    frame_index *index = calloc(1, sizeof(*index));
+    if(!index || !(index->name = strdup(name)))
+        goto fail;
+    index->id = *id;
+
+    if(count_frames(input, input_size, &index->frame_count))
+        goto fail;
+
+    const uint8_t *jxli;
+    size_t jxli_size;
+    find_codestream(input, input_size, index, &jxli, &jxli_size);
+    if(jxli && index->codestream_size > 0)
+        parse_frame_index_box(jxli, jxli_size, index);
+
+    // Splicing the headers onto a keyframe relies on the first offset being exactly where they end.
+    // If it isn't, decoding just starts from the beginning and skips frames.
+    if(index->num_keyframes > 0 &&
+       !check_header_size(input + index->codestream_offset, index->keyframes[0].offset))
+    {
+        DEBUG_PRINTF("Ignoring frame index box: its first offset isn't the end of the headers");
+        free(index->keyframes);
+        index->keyframes = NULL;
+        index->num_keyframes = 0;
+    }
+
+    return index;
+
+fail:
+    frame_index_free(index);
+    return NULL;
+}
+
+/**
+ * @brief Find a file's index in the cache.  The cache must be locked.
+ *
+ * @return The link to the index, which points to @c NULL if it isn't there.
+ */
+static frame_index **frame_index_find(const char *name, const file_id *id)
+{
+    frame_index **link;
+    for(link = &frame_index_cache.head; *link; link = &(*link)->next)
+    {
+        const frame_index *index = *link;
+        if(file_id_equal(&index->id, id) && strcmp(index->name, name) == 0)
+            break;
+    }
+    return link;
+}
+
+/**
+ * @brief Get the number of frames in a file, and the quickest place to start decoding one of them.
+ *
+ * The first call for a file walks all of its frame headers, and reads the jxli box if there is one.
+ * What's found is kept for the next few files, so that later calls don't depend on the number of frames.
+ *
+ * If the file lists its keyframes, @p restart gives the last keyframe before the requested frame.  A
+ * codestream made of the headers followed by everything from that keyframe on decodes the requested frame
+ * without touching anything before the keyframe.
+ *
+ * @param[in] name File name.
+ * @param[in] input,input_size The whole JPEG XL file.
+ * @param[in] frame The 1-based frame number wanted.
+ * @param[out] frame_count Receives the number of frames.
+ * @param[out] restart Receives the keyframe to restart from.  Its @c header_size is 0 if there isn't one.
+ *
+ * @return 0 on success.
+ */
+static int frame_index_lookup(const char *name, FILE *fp, const uint8_t *input, size_t input_size, int frame,
+                              int *frame_count, frame_restart *restart)
+{
+    pthread_once(&frame_index_cache.once, frame_index_init);
+
+    if(!name)
+        name = "";
+    file_id id;
+    file_id_get(fp, input, input_size, &id);
+
+    frame_index *index, *built = NULL, **link;
+
+    pthread_mutex_lock(&frame_index_cache.lock);
+    link = frame_index_find(name, &id);
+    if(*link)
+    {
+        STATS_INC(frame_index_hits);
+    }
+    else
+    {
+        // Read the frame headers without holding the lock
+        pthread_mutex_unlock(&frame_index_cache.lock);
+        STATS_INC(frame_index_misses);
+        if(!(built = frame_index_build(name, input, input_size, &id)))
+            return -1;
+        pthread_mutex_lock(&frame_index_cache.lock);
+
+        // Another load of the same file may have got there first, in which case use its index
+        link = frame_index_find(name, &id);
+        if(!*link)
+        {
+            *link = built;
+            built = NULL;
+        }
+    }
+
+    // Move to the front.  The index is only used with the lock held, since it can be dropped at any other time.
+    index = *link;
+    *link = index->next;
+    index->next = frame_index_cache.head;
+    frame_index_cache.head = index;
+
+    *frame_count = index->frame_count;
+    *restart = (frame_restart){ .header_size = 0 };
+    for(size_t i=index->num_keyframes; i-- > 1; )
+    {
+        if(index->keyframes[i].frame < (size_t)frame)
+        {
+            restart->codestream = input + index->codestream_offset;
+            restart->header_size = index->keyframes[0].offset;
+            restart->offset = index->keyframes[i].offset;
+            restart->frame = index->keyframes[i].frame;
+            restart->size = index->codestream_size - restart->offset;
+            break;
+        }
+    }
+
+    // Drop the least recently used if there are too many
+    int kept = 0;
+    for(link = &frame_index_cache.head; *link; link = &(*link)->next)
+    {
+        if(++kept == FRAME_INDEX_CACHE_CAPACITY)
+        {
+            while(*link && (*link)->next)
+            {
+                frame_index *old = (*link)->next;
+                (*link)->next = old->next;
+                frame_index_free(old);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&frame_index_cache.lock);
+
+    frame_index_free(built);
+    return 0;
+}
+
+/**
+ * @brief Stop restarting from the keyframes of a file's index.
+ *
+ * For when decoding from one of them fails: the jxli box can't be trusted, so from now on, frames of
+ * the file are reached by decoding from the start.
+ */
+static void frame_index_forget_keyframes(const char *name, FILE *fp, const uint8_t *input, size_t input_size)
+{
+    file_id id;
+    file_id_get(fp, input, input_size, &id);
+
+    pthread_mutex_lock(&frame_index_cache.lock);
+    frame_index *index = *frame_index_find(name ? name : "", &id);
+    if(index)
+    {
+        free(index->keyframes);
+        index->keyframes = NULL;
+        index->num_keyframes = 0;
+    }
+    pthread_mutex_unlock(&frame_index_cache.lock);
+}
+#endif // FF_IMAGE_ANIMATED
+
+
+/**
+ * Largest number of frames that can be decoded ahead.
+ */
+#define PREFETCH_MAX_DEPTH 16
+
+/**
+ * Options that change what load() produces.  Those that only make sense for one image are read from
+ * tags the caller attaches to it; the rest come from the environment.
+ */
+typedef struct
+{
+    unsigned scale;     ///< Produce an image 1/scale the size of the original (1, 2, 4 or 8)
+    size_t crop_x;      ///< Left edge of the region to load, in full-size pixels
+    size_t crop_y;      ///< Top edge of the region to load, in full-size pixels
+    size_t crop_w;      ///< Width of the region to load, or 0 to load the whole image
+    size_t crop_h;      ///< Height of the region to load
+    size_t preview_size; ///< Load the embedded preview instead if neither side of it is smaller than this, or 0 never to
+    int prefetch;       ///< Number of animation frames to decode ahead, or 0 not to
+    bool coalesce;      ///< Let libjxl compose animation frames, rather than composing only the changed areas ourselves
+    bool passthrough;   ///< Keep the original file, so an unmodified image can be saved without re-encoding
+} load_options;
+
+/**
+ * Load options that come from the environment.  It's read once, by the first load, since another
+ * thread could be changing it.
+ */
+static struct
+{
+    pthread_once_t once;
+    size_t preview_size;
+    int prefetch;
+    bool coalesce;
+    bool passthrough;
+} load_env = { .once = PTHREAD_ONCE_INIT };
+
+/**
+ * @brief Read the load options that come from the environment.
+ *
+ * - IMLIB2_JXL_PREVIEW: The size of the thumbnail wanted.  A preview at least this large is loaded
+ *   instead of the main image.
+ * - IMLIB2_JXL_PREFETCH: Number of animation frames to decode in the background ahead of the one requested.
+ * - IMLIB2_JXL_COALESCE: 0 to compose animation frames in the loader.
+ * - IMLIB2_JXL_PASSTHROUGH: 1 to keep the original file of each image loaded.
+ */
+static void load_env_init(void)
+{
+    const char *env;
+
+    load_env.preview_size = 0;
+    if((env = getenv("IMLIB2_JXL_PREVIEW")))
+        load_env.preview_size = strtoul(env, NULL, 10);
+
+    load_env.prefetch = 0;
+    if((env = getenv("IMLIB2_JXL_PREFETCH")))
+    {
+        const unsigned long depth = strtoul(env, NULL, 10);
+        load_env.prefetch = (depth < PREFETCH_MAX_DEPTH) ? depth : PREFETCH_MAX_DEPTH;
+    }
+
+    load_env.coalesce = true;
+    if((env = getenv("IMLIB2_JXL_COALESCE")))
+        load_env.coalesce = strtoul(env, NULL, 10) != 0;
+
+    load_env.passthrough = false;
+    if((env = getenv("IMLIB2_JXL_PASSTHROUGH")))
+        load_env.passthrough = strtoul(env, NULL, 10) != 0;
+}
+
+/**
+ * @brief Read the load options for @p im.
+ *
+ * These tags are read from the image:
+ * - jxl-scale: 1, 2, 4 or 8.  Other values are ignored.
+ * - jxl-crop-x, jxl-crop-y, jxl-crop-width, jxl-crop-height: A rectangle of the full-size image to load
+ *   instead of the whole thing.  Ignored unless the width and height are both given and positive.
+ * - jxl-preview: The size of the thumbnail wanted, or 0 never to load the preview, overriding
+ *   IMLIB2_JXL_PREVIEW.  Negative values are ignored.
+ * - jxl-passthrough: Nonzero to keep the original file, 0 not to, overriding IMLIB2_JXL_PASSTHROUGH.
+ */
+static void get_load_options(ImlibImage *im, load_options *opts)
+{
+    const ImlibImageTag *tag;
+
+    opts->scale = 1;
+    if((tag = __imlib_GetTag(im, "jxl-scale")))
+    {
+        if(tag->val == 1 || tag->val == 2 || tag->val == 4 || tag->val == 8)
+            opts->scale = tag->val;
+        else
+            WARN_PRINTF("Ignoring unsupported jxl-scale %d", tag->val);
+    }
+
+    opts->crop_x = opts->crop_y = opts->crop_w = opts->crop_h = 0;
+    const ImlibImageTag *crop_w = __imlib_GetTag(im, "jxl-crop-width");
+    const ImlibImageTag *crop_h = __imlib_GetTag(im, "jxl-crop-height");
+    if(crop_w && crop_h && crop_w->val > 0 && crop_h->val > 0)
+    {
+        opts->crop_w = crop_w->val;
+        opts->crop_h = crop_h->val;
+        if((tag = __imlib_GetTag(im, "jxl-crop-x")) && tag->val > 0)
+            opts->crop_x = tag->val;
+        if((tag = __imlib_GetTag(im, "jxl-crop-y")) && tag->val > 0)
+            opts->crop_y = tag->val;
+    }
+
+    pthread_once(&load_env.once, load_env_init);
+    opts->preview_size = load_env.preview_size;
+    opts->prefetch = load_env.prefetch;
+    opts->coalesce = load_env.coalesce;
+    opts->passthrough = load_env.passthrough;
+    if((tag = __imlib_GetTag(im, "jxl-preview")))
+    {
+        if(tag->val >= 0)
+            opts->preview_size = tag->val;
+        else
+            WARN_PRINTF("Ignoring negative jxl-preview %d", tag->val);
+    }
+    if((tag = __imlib_GetTag(im, "jxl-passthrough")))
+        opts->passthrough = tag->val != 0;
+}
+
+
+/**
+ * Where the image-out callback should put the pixels it receives from libjxl.
+ */
+typedef struct
+{
+    uint32_t *data;     ///< ARGB pixels of the (possibly cropped and reduced) image
+    size_t width;       ///< Width of @c data in pixels
+    int num_channels;   ///< Number of channels in each pixel from libjxl
+    unsigned scale;     ///< Keep only every scale'th pixel of every scale'th row
+    size_t x0, y0;      ///< Top-left of the region of the full-size image that is kept (inclusive)
+    size_t x1, y1;      ///< Bottom-right of the region that is kept (exclusive)
+    call_timing *timing;       ///< Where to add the time spent converting, or @c NULL
+
+    // Progress reporting, used only for full-size loads with a progress callback
+    ImlibImage *im;            ///< Image to report progress for
+    pthread_t caller;          ///< The thread that called load(), which alone may report progress
+    atomic_uint *row_pixels;   ///< Number of pixels received for each row of @c data, or @c NULL not to report
+    size_t full_width;         ///< Width of the full-size image, i.e. the pixels that make up a row
+    int rows_done;             ///< Rows converted and reported so far (only touched by @c caller)
+    bool cancelled;            ///< Whether the progress callback asked to stop (only touched by @c caller)
+    void *runner;              ///< Runner to cancel when the progress callback asks to stop
+#ifdef IMLIB2JXL_USE_LCMS
+    uint8_t *icc_blob;         ///< Profile to convert finished rows from, if @c icc_size > 0
+    size_t icc_size;
+#endif
+} decode_target;
+
+/**
+ * Number of pixels gathered at a time when subsampling.
+ */
+#define SUBSAMPLE_BATCH 256
+
+/**
+ * @brief Convert and report the rows at the top of the image that have all their pixels.
+ *
+ * Only called on the thread that called load(), because imlib2's progress callback may draw.  If
+ * the callback asks to stop, the runner is cancelled, which makes libjxl fail the decode.
+ */
+static void decode_report_rows(decode_target *target)
+{
+    const int height = target->im->h;
+    int rows = target->rows_done;
+    while(rows < height &&
+          atomic_load_explicit(&target->row_pixels[rows], memory_order_acquire) >= target->full_width)
+        ++rows;
+    if(rows == target->rows_done || target->cancelled)
+        return;
+
+#ifdef IMLIB2JXL_USE_LCMS
+    if(target->icc_size > 0)
+    {
+        const uint64_t started = timing_now(target->timing);
+        if(convert_to_srgb(target->icc_blob, target->icc_size, target->data + (size_t)target->rows_done * target->width,
+                           target->width, rows - target->rows_done, target->num_channels, NULL))
+            WARN_PRINTF("Color space transformation failed, but continuing anyway");
+        timing_end_phase(target->timing, PHASE_COLOR, started);
+    }
+#endif
+
+    if(__imlib_LoadProgressRows(target->im, target->rows_done, rows - target->rows_done))
+    {
+        DEBUG_PRINTF("Cancelled by progress callback");
+        target->cancelled = true;
+        runner_cancel(target->runner);
+    }
+    target->rows_done = rows;
+}
+
+/**
+ * Image-out callback for JxlDecoderSetImageOutCallback.
+ *
+ * Converts each run of pixels straight into imlib2's buffer, dropping any that fall outside the
+ * crop region or between the samples of a reduced-size image.  This may be called simultaneously
+ * by several worker threads, but never for overlapping pixels.
+ *
+ * When reporting progress, it also counts the pixels each row has received, and when it's called
+ * on the loading thread, reports the rows that are complete.
+ */
+static void decode_image_out(void *opaque, size_t x, size_t y, size_t num_pixels, const void *pixels)
+{
+    decode_target *target = opaque;
+    const unsigned scale = target->scale;
+    const int num_channels = target->num_channels;
+
+    if(y < target->y0 || y >= target->y1 || (y - target->y0) % scale)
+        return;
+
+    // Clip the run to the crop region, then move to the first pixel that's on the sampling grid
+    size_t start = (x > target->x0) ? x : target->x0;
+    const size_t end = (x + num_pixels < target->x1) ? x + num_pixels : target->x1;
+    if(start < end)
+        start += (scale - (start - target->x0) % scale) % scale;
+
+    if(start < end)
+    {
+        const uint64_t started = timing_now(target->timing);
+        const uint8_t *src = (const uint8_t*)pixels + (start - x) * num_channels;
+        const size_t out_pixels = (end - start + scale - 1) / scale;
+        uint32_t *dst = target->data + ((y - target->y0) / scale) * target->width + (start - target->x0) / scale;
+
+        if(scale == 1)
+        {
+            swizzle_to_argb(dst, src, out_pixels, num_channels);
+        }
+        else
+        {
+            // Reduced size: keep the top-left pixel of every scale*scale block
+            uint8_t batch[SUBSAMPLE_BATCH * 4];
+            for(size_t done = 0; done < out_pixels; )
+            {
+                const size_t n = (out_pixels - done < SUBSAMPLE_BATCH) ? out_pixels - done : SUBSAMPLE_BATCH;
+                for(size_t i=0; i<n; ++i)
+                    memcpy(batch + i * num_channels, src + (done + i) * scale * num_channels, num_channels);
+                swizzle_to_argb(dst + done, batch, n, num_channels);
+                done += n;
+            }
+        }
+        timing_end_phase(target->timing, PHASE_SWIZZLE, started);
+    }
+
+    if(target->row_pixels)
+    {
+        // Count the whole run, kept or not, after storing it, so whoever sees the row complete
+        // also sees its pixels.  (Progress is only reported at full size, so rows aren't skipped.)
+        atomic_fetch_add_explicit(&target->row_pixels[y - target->y0], num_pixels, memory_order_release);
+        if(pthread_equal(pthread_self(), target->caller))
+            decode_report_rows(target);
+    }
+}
+
+
+#ifdef FF_IMAGE_ANIMATED
+/**
+ * Number of animations that can be played back with prefetching at once.
+ */
+#define PREFETCH_MAX_SESSIONS 2
+
+/**
+ * A buffer in a playback session's ring.
+ */
+typedef struct
+{
+    uint32_t *pixels;   ///< ARGB pixels of the whole canvas
+    int frame;          ///< 1-based number of the frame held, 0 if empty, or minus the number of the frame being decoded into it
+    int delay;          ///< Duration of the frame in milliseconds
+} prefetch_slot;
+
+/**
+ * The canvas a session composes layers onto when libjxl isn't coalescing them.
+ *
+ * Each state of the canvas gets a version number, so that a layer can be checked to be blending
+ * onto the state that's actually on the canvas.  Version 0 is the initial, fully transparent canvas.
+ */
+typedef struct
+{
+    uint32_t *pixels;           ///< The whole canvas, ARGB
+    uint32_t *layer;            ///< The current layer's pixels, ARGB
+    size_t layer_capacity;      ///< Size of @c layer in pixels
+    JxlLayerInfo layer_info;    ///< Position and blending of the current layer
+    bool displayed;             ///< Whether the canvas is shown after the current layer
+    unsigned version;           ///< Version of what's on the canvas
+    unsigned last_version;      ///< Most recently assigned version
+    unsigned saved[4];          ///< Version saved in each of libjxl's reference slots by a frame we've seen, or 0
+    bool float_alpha;           ///< Whether the alpha channel is floating point, so may be out of range
+} prefetch_canvas;
+
+/**
+ * Playback of one animation.
+ *
+ * A task on the shared worker threads decodes the frames following the last one asked for into a ring
+ * of buffers, so when a viewer asks for the next frame, it's usually ready.  The task decodes one frame
+ * each time it runs, then queues itself again, so other work gets a turn on the workers in between.
+ */
+typedef struct prefetch_session
+{
+    struct prefetch_session *next;
+    unsigned refs;              ///< One for the session list, plus one for each load() using it.  Protected by the list's lock.
+    char *name;
+    size_t file_size;
+    file_id id;
+    uint8_t *input;             ///< The session's own mapping or copy of the file
+    bool input_mapped;          ///< Whether @c input is a mapping, rather than a malloc()ed copy
+    int frame_count;
+    int depth;                  ///< Number of slots; 0 to compose frames on the calling thread, without a task
+    bool coalesce;              ///< Whether libjxl composes the frames, rather than the session
+
+    // Only used by the task, which never runs on two threads at once
+    pool_task task;
+    JxlDecoder *dec;
+    void *runner;
+    uint8_t *icc_blob;
+    size_t icc_size;
+    int next_frame;             ///< The frame the decoder will produce next
+    JxlPixelFormat pixel_format;
+    bool coalescing;            ///< Whether @c dec is coalescing, which it may be even if @c coalesce isn't
+    prefetch_canvas canvas;
+
+    pthread_mutex_t lock;       ///< Protects everything below
+    pthread_cond_t cond;        ///< Broadcast whenever anything below changes
+    bool scheduled;             ///< The task is queued or running
+    bool stop;                  ///< Set to keep the task from running again
+    bool failed;                ///< Set by the task if it can't decode any more
+    bool have_info;             ///< The image description below is valid
+    int w, h;
+    bool has_alpha;
+    bool animated;
+    int loop_count;
+    int want;                   ///< The first frame the ring should hold
+    prefetch_slot *slots;
+} prefetch_session;
+
+/**
+ * Playback sessions, most recently used first.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    prefetch_session *head;
+} prefetch_sessions = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static void prefetch_atfork_prepare(void)
+{
+    pthread_mutex_lock(&prefetch_sessions.lock);
+}
+
+static void prefetch_atfork_parent(void)
+{
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+}
+
+static void prefetch_atfork_child(void)
+{
+    // The workers running the tasks don't exist in the child, so the sessions can't be used or even safely freed
+    prefetch_sessions.head = NULL;
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+}
+
+static void prefetch_init(void)
+{
+    if(pthread_atfork(prefetch_atfork_prepare, prefetch_atfork_parent, prefetch_atfork_child) != 0)
+        WARN_PRINTF("Failed in pthread_atfork");
+}
+
+/**
+ * @brief Whether @p frame is one the ring should be holding.  The session must be locked.
+ */
+static bool prefetch_wanted(const prefetch_session *session, int frame)
+{
+    const int ahead = (frame - session->want + session->frame_count) % session->frame_count;
+    return ahead < session->depth;
+}
+
+/**
+ * @brief Decide what the task should decode next, and where.  The session must be locked.
+ *
+ * @param[out] frame Receives the number of the frame to decode.
+ *
+ * @return The slot to decode it into, or @c NULL if the ring already holds every frame it should.
+ */
+static prefetch_slot *prefetch_next_job(prefetch_session *session, int *frame)
+{
+    const int window = (session->depth < session->frame_count) ? session->depth : session->frame_count;
+
+    for(int i=0; i<window; ++i)
+    {
+        const int candidate = (session->want - 1 + i) % session->frame_count + 1;
+        bool held = false;
+        prefetch_slot *free_slot = NULL;
+        for(int j=0; j<session->depth; ++j)
+        {
+            prefetch_slot *slot = &session->slots[j];
+            if(abs(slot->frame) == candidate)
+                held = true;
+            else if(!free_slot && (slot->frame == 0 || (slot->frame > 0 && !prefetch_wanted(session, slot->frame))))
+                free_slot = slot;
+        }
+        if(!held)
+        {
+            *frame = candidate;
+            return free_slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Go back to the state before the first frame.
+ */
+static void prefetch_canvas_reset(prefetch_canvas *canvas)
+{
+    canvas->version = canvas->last_version = 0;
+    memset(canvas->saved, 0, sizeof(canvas->saved));
+}
+
+/**
+ * @brief Alpha-blend one non-premultiplied ARGB pixel over another, as for JXL_BLEND_BLEND.
+ *
+ * libjxl blends the layers in floating point and then rounds to 8 bits, whereas this works on the
+ * 8-bit layers, so a channel can come out 1 away from what libjxl would produce.
+ */
+static inline uint32_t blend_pixel(uint32_t dst, uint32_t src)
+{
+    const uint32_t sa = src >> 24;
+    if(sa == 255)
+        return src;
+    if(sa == 0)
+        return dst;
+
+    const uint32_t da = dst >> 24;
+    const uint32_t oa255 = sa * 255 + da * (255 - sa); // Output alpha, times 255
+    uint32_t out = ((oa255 + 127) / 255) << 24;
+    for(int shift=0; shift<24; shift+=8)
+    {
+        const uint32_t sc = (src >> shift) & 0xff;
+        const uint32_t dc = (dst >> shift) & 0xff;
+        const uint32_t c = (sc * sa * 255 + dc * da * (255 - sa) + oa255 / 2) / oa255;
+        out |= ((c > 255) ? 255 : c) << shift;
+    }
+    return out;
+}
+
+/**
+ * @brief Put the current layer onto the canvas.
+ *
+ * Only the part of the canvas the layer covers is touched.
+ */
+static void prefetch_canvas_compose(prefetch_canvas *canvas, size_t canvas_w, size_t canvas_h)
+{
+    const JxlLayerInfo *info = &canvas->layer_info;
+    const int64_t x0 = info->have_crop ? info->crop_x0 : 0;
+    const int64_t y0 = info->have_crop ? info->crop_y0 : 0;
+
+    // Clip the layer to the canvas
+    const int64_t left = (x0 < 0) ? 0 : x0;
+    const int64_t top = (y0 < 0) ? 0 : y0;
+    const int64_t right = (x0 + info->xsize < (int64_t)canvas_w) ? x0 + info->xsize : (int64_t)canvas_w;
+    const int64_t bottom = (y0 + info->ysize < (int64_t)canvas_h) ? y0 + info->ysize : (int64_t)canvas_h;
+    if(left >= right || top >= bottom)
+        return;
+
+    for(int64_t y=top; y<bottom; ++y)
+    {
+        uint32_t *dst = canvas->pixels + y * canvas_w + left;
+        const uint32_t *src = canvas->layer + (y - y0) * info->xsize + (left - x0);
+        if(info->blend_info.blendmode == JXL_BLEND_REPLACE)
+        {
+            memcpy(dst, src, (right - left) * sizeof(uint32_t));
+        }
+        else
+        {
+            for(int64_t x=0; x<right-left; ++x)
+                dst[x] = blend_pixel(dst[x], src[x]);
+        }
+    }
+}
+
+/**
+ * @brief Check that the layer described by @c canvas->layer_info can be composed by the loader.
+ *
+ * Only replacing and alpha-blending are supported, and only onto the canvas as it is.
+ *
+ * libjxl doesn't show us reference-only frames (such as the patch dictionary, which its encoder
+ * keeps in slot 3), so a slot that no frame we've seen has saved to may hold one.  Layers that go on
+ * top of one of those are left to libjxl.
+ *
+ * @return true if it can.
+ */
+static bool prefetch_canvas_can_compose(prefetch_canvas *canvas, size_t canvas_w, size_t canvas_h)
+{
+    const JxlLayerInfo *info = &canvas->layer_info;
+
+    if(info->blend_info.blendmode != JXL_BLEND_REPLACE &&
+       (info->blend_info.blendmode != JXL_BLEND_BLEND || info->blend_info.alpha != 0))
+        return false;
+
+    // For alpha-blending, clamp only limits the layer's alpha to [0, 1], which integer alpha already is
+    if(info->blend_info.blendmode == JXL_BLEND_BLEND && !info->blend_info.clamp && canvas->float_alpha)
+        return false;
+
+    const bool covers_canvas = !info->have_crop ||
+                               (info->crop_x0 <= 0 && info->crop_y0 <= 0 &&
+                                info->crop_x0 + (int64_t)info->xsize >= (int64_t)canvas_w &&
+                                info->crop_y0 + (int64_t)info->ysize >= (int64_t)canvas_h);
+    if(info->blend_info.blendmode == JXL_BLEND_REPLACE && covers_canvas)
+        return true;
+
+    // The layer goes on top of a saved frame, which had better be what's on the canvas
+    const unsigned slot = info->blend_info.source & 3;
+    return slot != 3 && canvas->saved[slot] != 0 && canvas->saved[slot] == canvas->version;
+}
+
+/**
+ * @brief Decode the decoder's next frame into @p slot.
+ *
+ * Called by the session's task without the session locked.  The first call also fills in the
+ * session's image description.
+ *
+ * If @p canvas is given, the decoder isn't coalescing, and this decodes layers and composes them onto
+ * the canvas until a frame that's displayed.  The canvas is left holding that frame.
+ *
+ * @param[in,out] slot Receives the frame's duration and, if @p canvas is @c NULL, its pixels.
+ *
+ * @return 0 on success, -1 on failure, or 1 if the file needs compositing that @p canvas can't do.
+ */
+static int prefetch_decode_frame(prefetch_session *session, JxlDecoder *dec, void *runner, prefetch_slot *slot,
+                                 prefetch_canvas *canvas, JxlPixelFormat *pixel_format, uint8_t **icc_blob, size_t *icc_size)
+{
+    int retval = -1;
+    JxlDecoderStatus res;
+    decode_target target = { .data = NULL };
+
+#ifndef IMLIB2JXL_USE_LCMS
+    (void)icc_blob;
+    (void)icc_size;
+#endif
+
+    for(;;)
+    {
+        switch((res = JxlDecoderProcessInput(dec)))
+        {
+        case JXL_DEC_BASIC_INFO:
+        {
+            // Seen again after every rewind
+            JxlBasicInfo basic_info;
+            if(session->have_info)
+                break;
+            if(JxlDecoderGetBasicInfo(dec, &basic_info) != JXL_DEC_SUCCESS)
+                RETURN_ERR(-1, "Failed in JxlDecoderGetBasicInfo");
+            if(!IMAGE_DIMENSIONS_OK(basic_info.xsize, basic_info.ysize))
+                RETURN_ERR(-1, "Dimensions %ux%u are not supported by imlib2", basic_info.xsize, basic_info.ysize);
+            if(canvas && basic_info.alpha_premultiplied)
+                return 1;
+            if(canvas)
+                canvas->float_alpha = basic_info.alpha_exponent_bits > 0;
+            runner_fit_image(runner, basic_info.xsize, basic_info.ysize);
+            pixel_format->num_channels = ((basic_info.num_color_channels >= 3) ? 3 : 1) + (basic_info.alpha_bits > 0);
+
+            pthread_mutex_lock(&session->lock);
+            session->w = basic_info.xsize;
+            session->h = basic_info.ysize;
+            session->has_alpha = basic_info.alpha_bits > 0;
+            session->animated = basic_info.have_animation;
+            session->loop_count = basic_info.animation.num_loops;
+            session->have_info = true;
+            pthread_cond_broadcast(&session->cond);
+            pthread_mutex_unlock(&session->lock);
+            break;
+        }
+
+#ifdef IMLIB2JXL_USE_LCMS
+        case JXL_DEC_COLOR_ENCODING:
+            if(!*icc_blob && get_color_profile(dec, pixel_format->num_channels <= 2, icc_blob, icc_size))
+                RETURN_ERR(-1, "Failed to get color profile");
+            break;
+#endif
+
+        case JXL_DEC_FRAME:
+        {
+            JxlFrameHeader frame_header;
+            JxlBasicInfo basic_info;
+            if(JxlDecoderGetFrameHeader(dec, &frame_header) != JXL_DEC_SUCCESS ||
+               JxlDecoderGetBasicInfo(dec, &basic_info) != JXL_DEC_SUCCESS)
+                RETURN_ERR(-1, "Failed to get frame header");
+            slot->delay = 0;
+            if(basic_info.have_animation && basic_info.animation.tps_numerator > 0)
+            {
+                slot->delay = (uint64_t)frame_header.duration * 1000 * basic_info.animation.tps_denominator
+                              / basic_info.animation.tps_numerator;
+            }
+
+            if(canvas)
+            {
+                if(!canvas->pixels && !(canvas->pixels = calloc((size_t)session->w * session->h, sizeof(uint32_t))))
+                    RETURN_ERR(-1, "Failed to allocate a %dx%d canvas", session->w, session->h);
+                canvas->layer_info = frame_header.layer_info;
+                canvas->displayed = frame_header.duration > 0 || frame_header.is_last;
+                if(!prefetch_canvas_can_compose(canvas, session->w, session->h))
+                    return 1;
+            }
+            break;
+        }
+
+        case JXL_DEC_NEED_IMAGE_OUT_BUFFER:
+            target.num_channels = pixel_format->num_channels;
+            target.scale = 1;
+            if(canvas)
+            {
+                // Only the layer itself is decoded, converted and swizzled
+                const size_t layer_pixels = (size_t)canvas->layer_info.xsize * canvas->layer_info.ysize;
+                if(layer_pixels > canvas->layer_capacity)
+                {
+                    free(canvas->layer);
+                    canvas->layer_capacity = 0;
+                    if(!(canvas->layer = malloc(layer_pixels * sizeof(uint32_t))))
+                        RETURN_ERR(-1, "Failed to allocate %zu B for layer", layer_pixels * sizeof(uint32_t));
+                    canvas->layer_capacity = layer_pixels;
+                }
+                target.data = canvas->layer;
+                target.width = target.x1 = canvas->layer_info.xsize;
+                target.y1 = canvas->layer_info.ysize;
+            }
+            else
+            {
+                if(!slot->pixels && !(slot->pixels = malloc((size_t)session->w * session->h * sizeof(uint32_t))))
+                    RETURN_ERR(-1, "Failed to allocate a %dx%d frame", session->w, session->h);
+                target.data = slot->pixels;
+                target.width = target.x1 = session->w;
+                target.y1 = session->h;
+            }
+            if(JxlDecoderSetImageOutCallback(dec, pixel_format, decode_image_out, &target) != JXL_DEC_SUCCESS)
+                RETURN_ERR(-1, "Failed in JxlDecoderSetImageOutCallback");
+            break;
+
+        case JXL_DEC_FULL_IMAGE:
+        {
+            uint32_t *pixels = canvas ? canvas->layer : slot->pixels;
+            const size_t width = target.width;
+            const size_t height = target.y1;
+#ifdef IMLIB2JXL_USE_LCMS
+            if(*icc_size > 0)
+            {
+                if(convert_to_srgb(*icc_blob, *icc_size, pixels, width, height, pixel_format->num_channels, runner))
+                    WARN_PRINTF("Color space transformation failed, but continuing anyway");
+            }
+#else
+            (void)pixels;
+            (void)width;
+            (void)height;
+#endif
+            if(!canvas)
+                return 0;
+
+            prefetch_canvas_compose(canvas, session->w, session->h);
+            canvas->version = ++canvas->last_version;
+            // A displayed frame saved to slot 0 isn't saved at all
+            if(!canvas->displayed || canvas->layer_info.save_as_reference != 0)
+                canvas->saved[canvas->layer_info.save_as_reference & 3] = canvas->version;
+            if(canvas->displayed)
+                return 0;
+            break;
+        }
+
+        case JXL_DEC_ERROR:
+            RETURN_ERR(-1, "Error while decoding: corrupted file?");
+
+        default:
+            RETURN_ERR(-1, "Unexpected result from JxlDecoderProcessInput");
+        }
+    }
+
+ret:
+    return retval;
+}
+
+/**
+ * @brief Create a decoder for a session's task.
+ *
+ * @return The decoder, or @c NULL on failure.
+ */
+static JxlDecoder *prefetch_decoder_create(prefetch_session *session, void *runner, bool coalesce)
+{
+    JxlDecoder *dec;
+    int events = JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE;
+#ifdef IMLIB2JXL_USE_LCMS
+    events |= JXL_DEC_COLOR_ENCODING;
+#endif
+    // The decoder lasts as long as the session, so its memory use isn't attributed to any one load
+    const JxlMemoryManager memory_manager = mem_manager(NULL);
+
+    if(!(dec = JxlDecoderCreate(&memory_manager)))
+        return NULL;
+    if(JxlDecoderSetParallelRunner(dec, pool_run, runner) != JXL_DEC_SUCCESS ||
+       JxlDecoderSubscribeEvents(dec, events) != JXL_DEC_SUCCESS ||
+       (!coalesce && JxlDecoderSetCoalescing(dec, JXL_FALSE) != JXL_DEC_SUCCESS) ||
+       JxlDecoderSetInput(dec, session->input, session->file_size) != JXL_DEC_SUCCESS)
+    {
+        JxlDecoderDestroy(dec);
+        return NULL;
+    }
+    JxlDecoderCloseInput(dec);
+    return dec;
+}
+
+#ifdef IMLIB2JXL_DEBUG
+/**
+ * @brief Check a frame the session composed against libjxl's compositing of the same frame.
+ *
+ * Warns if any channel differs by more than the rounding blend_pixel() allows.  Colors under fully
+ * transparent pixels don't count.  This decodes the animation again from the start for every frame,
+ * so it's only for debug builds.
+ */
+static void prefetch_check_composed(prefetch_session *session, void *runner, int frame, const uint32_t *pixels)
+{
+    prefetch_slot check = { .pixels = NULL };
+    JxlPixelFormat pixel_format = session->pixel_format;
+    uint8_t *icc_blob = NULL;
+    size_t icc_size = 0;
+    JxlDecoder *dec;
+
+    if(!(dec = prefetch_decoder_create(session, runner, true)))
+        return;
+    if(frame > 1)
+        JxlDecoderSkipFrames(dec, frame - 1);
+    if(prefetch_decode_frame(session, dec, runner, &check, NULL, &pixel_format, &icc_blob, &icc_size) == 0)
+    {
+        const size_t num_pixels = (size_t)session->w * session->h;
+        size_t num_different = 0;
+        int max_diff = 0;
+        for(size_t i=0; i<num_pixels; ++i)
+        {
+            if(!(pixels[i] >> 24) && !(check.pixels[i] >> 24))
+                continue;
+            int pixel_diff = 0;
+            for(int shift=0; shift<32; shift+=8)
+            {
+                const int diff = abs((int)((pixels[i] >> shift) & 0xff) - (int)((check.pixels[i] >> shift) & 0xff));
+                if(diff > pixel_diff)
+                    pixel_diff = diff;
+            }
+            if(pixel_diff > 1)
+                ++num_different;
+            if(pixel_diff > max_diff)
+                max_diff = pixel_diff;
+        }
+        if(num_different > 0)
+            WARN_PRINTF("Frame %d differs from libjxl's compositing in %zu pixels, by up to %d", frame, num_different, max_diff);
+        else
+            DEBUG_PRINTF("Frame %d matches libjxl's compositing (to within %d)", frame, max_diff);
+    }
+    JxlDecoderDestroy(dec);
+    free(check.pixels);
+    free(icc_blob);
+}
+#endif
+
+/**
+ * @brief Decode a frame into a slot with the session's decoder, setting the decoder up if necessary.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+static int prefetch_decode_next(prefetch_session *session, prefetch_slot *slot, int frame)
+{
+    int rc = 0;
+
+    if(!session->dec)
+    {
+        session->next_frame = 1;
+        session->coalescing = session->coalesce;
+        session->pixel_format = (JxlPixelFormat){
+                                    .num_channels = 4,
+                                    .data_type = JXL_TYPE_UINT8,
+                                    .endianness = JXL_NATIVE_ENDIAN,
+                                    .align = 0
+                                };
+        if((!session->runner && !(session->runner = runner_acquire(-1))) ||
+           !(session->dec = prefetch_decoder_create(session, session->runner, session->coalescing)))
+        {
+            WARN_PRINTF("Failed to set up decoder for prefetching");
+            return -1;
+        }
+    }
+    JxlDecoder *dec = session->dec;
+    void *runner = session->runner;
+
+    // Go back to the start if this frame has already gone by
+    if(frame < session->next_frame)
+    {
+        JxlDecoderRewind(dec);
+        if(JxlDecoderSetInput(dec, session->input, session->file_size) == JXL_DEC_SUCCESS)
+            JxlDecoderCloseInput(dec);
+        else
+            rc = -1;
+        prefetch_canvas_reset(&session->canvas);
+        session->next_frame = 1;
+    }
+
+    if(session->coalescing)
+    {
+        if(rc == 0 && frame > session->next_frame)
+            JxlDecoderSkipFrames(dec, frame - session->next_frame);
+        if(rc == 0)
+            rc = prefetch_decode_frame(session, dec, runner, slot, NULL, &session->pixel_format, &session->icc_blob, &session->icc_size);
+    }
+    else
+    {
+        // Every layer has to be composed to keep the canvas right, so nothing can be skipped
+        for(; rc == 0 && session->next_frame <= frame; ++session->next_frame)
+            rc = prefetch_decode_frame(session, dec, runner, slot, &session->canvas, &session->pixel_format, &session->icc_blob, &session->icc_size);
+        if(rc == 0)
+        {
+            const size_t canvas_size = (size_t)session->w * session->h * sizeof(uint32_t);
+            if(slot->pixels || (slot->pixels = malloc(canvas_size)))
+                memcpy(slot->pixels, session->canvas.pixels, canvas_size);
+            else
+                rc = -1;
+#ifdef IMLIB2JXL_DEBUG
+            if(rc == 0)
+                prefetch_check_composed(session, runner, frame, slot->pixels);
+#endif
+        }
+        else if(rc > 0)
+        {
+            // Let libjxl do the compositing from now on
+            DEBUG_PRINTF("Animation needs compositing the loader doesn't support; coalescing instead");
+            session->coalescing = true;
+            JxlDecoderDestroy(dec);
+            rc = (dec = session->dec = prefetch_decoder_create(session, runner, true)) ? 0 : -1;
+            if(rc == 0 && frame > 1)
+                JxlDecoderSkipFrames(dec, frame - 1);
+            if(rc == 0)
+                rc = prefetch_decode_frame(session, dec, runner, slot, NULL, &session->pixel_format, &session->icc_blob, &session->icc_size);
+        }
+    }
+    session->next_frame = frame + 1;
+    return rc;
+}
+
+/**
+ * @brief Queue the session's task if it isn't already queued or running.  The session must be locked.
+ */
+static void prefetch_schedule(prefetch_session *session)
+{
+    if(session->scheduled || session->stop || session->failed)
+        return;
+    if(pool_task_submit(&session->task) == 0)
+        session->scheduled = true;
+    else
+        session->failed = true; // No workers to decode ahead
+    pthread_cond_broadcast(&session->cond);
+}
+
+/**
+ * @brief A session's task: decode the next frame the ring should hold, if there is one.
+ *
+ * Queues itself again afterwards, so the ring is kept filled with the frames from the one last asked for
+ * onwards, wrapping around at the end.  When the ring is full, it stops until prefetch_get() queues it.
+ */
+static void prefetch_task(void *arg)
+{
+    prefetch_session *session = arg;
+    prefetch_slot *slot = NULL;
+    int frame;
+
+    pthread_mutex_lock(&session->lock);
+    if(!session->stop && !session->failed)
+        slot = prefetch_next_job(session, &frame);
+    if(!slot)
+    {
+        session->scheduled = false;
+        pthread_cond_broadcast(&session->cond);
+        pthread_mutex_unlock(&session->lock);
+        return;
+    }
+    slot->frame = -frame;
+    pthread_mutex_unlock(&session->lock);
+
+    const bool ok = (prefetch_decode_next(session, slot, frame) == 0);
+
+    pthread_mutex_lock(&session->lock);
+    slot->frame = ok ? frame : 0;
+    if(!ok)
+        session->failed = true;
+    session->scheduled = false;
+    prefetch_schedule(session);
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * @brief Stop a session's task and free the session.
+ */
+static void prefetch_session_free(prefetch_session *session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->stop = true;
+    pthread_mutex_unlock(&session->lock);
+    const bool cancelled = pool_task_cancel(&session->task);
+
+    // If it wasn't waiting in the queue, it may be running, so wait for it to finish
+    pthread_mutex_lock(&session->lock);
+    if(cancelled)
+        session->scheduled = false;
+    while(session->scheduled)
+        pthread_cond_wait(&session->cond, &session->lock);
+    pthread_mutex_unlock(&session->lock);
+
+    if(session->dec)
+        JxlDecoderDestroy(session->dec);
+    runner_release(session->runner);
+    free(session->icc_blob);
+    free(session->canvas.pixels);
+    free(session->canvas.layer);
+    for(int i=0; i<session->depth; ++i)
+        free(session->slots[i].pixels);
+    free(session->slots);
+    if(session->input_mapped)
+        munmap(session->input, session->file_size);
+    else
+        free(session->input);
+    pthread_cond_destroy(&session->cond);
+    pthread_mutex_destroy(&session->lock);
+    free(session->name);
+    free(session);
+}
+
+/**
+ * @brief Give up a reference to a session, freeing it if that was the last.
+ */
+static void prefetch_session_release(prefetch_session *session)
+{
+    pthread_mutex_lock(&prefetch_sessions.lock);
+    const bool last = (--session->refs == 0);
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+
+    if(last)
+        prefetch_session_free(session);
+}
+
+__attribute__((destructor))
+static void prefetch_cleanup(void)
+{
+    pthread_mutex_lock(&prefetch_sessions.lock);
+    prefetch_session *session = prefetch_sessions.head;
+    prefetch_sessions.head = NULL;
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+
+    while(session)
+    {
+        prefetch_session *next = session->next;
+        prefetch_session_release(session);
+        session = next;
+    }
+}
+
+/**
+ * @brief Start a playback session for a file.
+ *
+ * imlib2's mapping of the file only lasts as long as load(), so the session maps the file imlib2 has
+ * open again, or if it can't, keeps a copy of it.
+ *
+ * @param[in] fp The file imlib2 has open, if any.
+ * @param[in] input,file_size The whole file, as imlib2 supplied it.
+ *
+ * @return The new session, with one reference for the caller, or @c NULL on failure.
+ */
+static prefetch_session *prefetch_session_create(const char *name, FILE *fp, const uint8_t *input, size_t file_size,
+                                                 const file_id *id, int frame, int frame_count, int depth, bool coalesce)
+{
+    prefetch_session *session = NULL;
+    struct stat st;
+    const int fd = fp ? fileno(fp) : -1;
+
+    void *mapping = MAP_FAILED;
+    if(fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size == file_size)
+        mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapping != MAP_FAILED && memcmp(mapping, input, file_size) != 0)
+    {
+        // Not the whole file, or it's changed since imlib2 mapped it
+        munmap(mapping, file_size);
+        mapping = MAP_FAILED;
+    }
+
+    if(!(session = calloc(1, sizeof(*session))) || !(session->name = strdup(name)) ||
+       (depth > 0 && !(session->slots = calloc(depth, sizeof(*session->slots)))))
+        goto fail;
+    if(mapping != MAP_FAILED)
+    {
+        session->input = mapping;
+        session->input_mapped = true;
+    }
+    else if((session->input = malloc(file_size)))
+        memcpy(session->input, input, file_size);
+    else
+        goto fail;
+    session->refs = 1;
+    session->file_size = file_size;
+    session->id = *id;
+    session->frame_count = frame_count;
+    session->depth = depth;
+    session->coalesce = coalesce;
+    session->want = frame;
+    session->task.func = prefetch_task;
+    session->task.arg = session;
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+
+    DEBUG_PRINTF("Started a playback session for %s, prefetching %d frames", name, depth);
+    return session;
+
+fail:
+    if(session)
+    {
+        free(session->slots);
+        free(session->name);
+        free(session);
+    }
+    if(mapping != MAP_FAILED)
+        munmap(mapping, file_size);
+    return NULL;
+}
+
+/**
+ * @brief Find the playback session for a file, starting one if there isn't one.
+ *
+ * @return The session, with a reference for the caller, or @c NULL on failure.
+ */
+static prefetch_session *prefetch_session_get(const char *name, FILE *fp, const uint8_t *input, size_t input_size,
+                                              int frame, int frame_count, int depth, bool coalesce)
+{
+    file_id id;
+    prefetch_session *session, **link;
+    prefetch_session *dropped = NULL;
+
+    pthread_once(&prefetch_sessions.once, prefetch_init);
+
+    file_id_get(fp, input, input_size, &id);
+    pthread_mutex_lock(&prefetch_sessions.lock);
+    for(link = &prefetch_sessions.head; (session = *link); link = &session->next)
+    {
+        if(file_id_equal(&session->id, &id) && strcmp(session->name, name) == 0)
+        {
+            *link = session->next;
+            if(session->depth == depth && session->frame_count == frame_count && session->coalesce == coalesce)
+            {
+                // Move to the front
+                session->next = prefetch_sessions.head;
+                prefetch_sessions.head = session;
+                ++session->refs;
+                pthread_mutex_unlock(&prefetch_sessions.lock);
+                return session;
+            }
+            dropped = session; // Settings have changed, so start again
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+
+    if(dropped)
+        prefetch_session_release(dropped);
+
+    if(!(session = prefetch_session_create(name, fp, input, input_size, &id, frame, frame_count, depth, coalesce)))
+        return NULL;
+
+    pthread_mutex_lock(&prefetch_sessions.lock);
+    ++session->refs;
+    session->next = prefetch_sessions.head;
+    prefetch_sessions.head = session;
+
+    // Stop the least recently used sessions if there are too many
+    int kept = 0;
+    dropped = NULL;
+    for(link = &prefetch_sessions.head; *link; link = &(*link)->next)
+    {
+        if(++kept == PREFETCH_MAX_SESSIONS)
+        {
+            dropped = (*link)->next;
+            (*link)->next = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_sessions.lock);
+
+    while(dropped)
+    {
+        prefetch_session *next = dropped->next;
+        prefetch_session_release(dropped);
+        dropped = next;
+    }
+    return session;
+}
+
+/**
+ * @brief Get a frame of an animation from its playback session.
+ *
+ * If the frame is already in the ring, its buffer is handed straight over.  Otherwise (an underrun), this
+ * waits for the session's task to decode it.  Either way, the task then moves on to the frames after it.
+ *
+ * With no prefetching, the frame is composed on the calling thread instead, and copied out of the
+ * session's canvas, which has to be kept for the next frame.
+ *
+ * On success, @p im has its size, pixels and frame information filled in.
+ *
+ * @param[in,out] im The image being loaded.
+ * @param[in] input,input_size The whole JPEG XL file.
+ * @param[in] frame The 1-based frame wanted.
+ * @param[in] frame_count Number of frames in the animation.
+ * @param[in] depth Number of frames to decode ahead, or 0 if @p coalesce is false and frames are
+ *                  only to be composed.
+ * @param[in] coalesce If false, the session composes each frame's layers itself, onto a canvas
+ *                     that persists between frames.
+ *
+ * @return 0 on success, or -1 if the frame should be decoded some other way.
+ */
+static int prefetch_get(ImlibImage *im, const uint8_t *input, size_t input_size, int frame, int frame_count,
+                        int depth, bool coalesce)
+{
+    int retval = -1;
+    prefetch_session *session;
+    prefetch_slot *slot = NULL;
+    prefetch_slot own = { .pixels = NULL };
+
+    if(!im->fi->name || !(session = prefetch_session_get(im->fi->name, im->fi->fp, input, input_size, frame, frame_count, depth, coalesce)))
+        return -1;
+
+    pthread_mutex_lock(&session->lock);
+    if(session->depth == 0)
+    {
+        // Take the decoder, waiting for any other load that's using it
+        while(session->scheduled)
+            pthread_cond_wait(&session->cond, &session->lock);
+        if(session->failed)
+            goto ret;
+        session->scheduled = true;
+        pthread_mutex_unlock(&session->lock);
+
+        const int rc = prefetch_decode_next(session, &own, frame);
+
+        pthread_mutex_lock(&session->lock);
+        session->scheduled = false;
+        if(rc == 0)
+            slot = &own;
+        else
+            session->failed = true;
+        pthread_cond_broadcast(&session->cond);
+    }
+    else
+    {
+        session->want = frame;
+        prefetch_schedule(session);
+
+        for(bool first = true; !session->failed; first = false)
+        {
+            for(int i=0; i<session->depth && !slot; ++i)
+            {
+                if(session->slots[i].frame == frame)
+                    slot = &session->slots[i];
+            }
+            if(slot)
+                break;
+            if(first)
+                STATS_INC(prefetch_underruns);
+            pthread_cond_wait(&session->cond, &session->lock);
+        }
+    }
+    if(!slot)
+        goto ret;
+
+    ImlibImageFrame *pf;
+    if(!(pf = __imlib_GetFrame(im)))
+        goto ret;
+    im->w = session->w;
+    im->h = session->h;
+    im->has_alpha = session->has_alpha;
+    // imlib2 frees the pixels with free(), so the buffer can be given away rather than copied
+    im->data = slot->pixels;
+    slot->pixels = NULL;
+    slot->frame = 0;
+
+    pf->canvas_w = im->w;
+    pf->canvas_h = im->h;
+    pf->frame_count = frame_count;
+    pf->frame_delay = slot->delay;
+    if(session->animated)
+    {
+        pf->frame_flags |= FF_IMAGE_ANIMATED;
+        pf->loop_count = session->loop_count;
+    }
+    if(session->depth > 0)
+    {
+        STATS_INC(prefetch_frames);
+
+        // Let the task reuse this slot for the frames after this one
+        session->want = frame % frame_count + 1;
+        prefetch_schedule(session);
+    }
+    retval = 0;
+
+ret:
+    pthread_mutex_unlock(&session->lock);
+    prefetch_session_release(session);
+    free(own.pixels);
+    return retval;
+}
+#endif // FF_IMAGE_ANIMATED
+
+
+/**
+ * Image tags that map directly to a libjxl frame setting.  Their values are clamped to [min, max].
+ */
+static const struct
+{
+    const char *tag;
+    JxlEncoderFrameSettingId id;
+    int min, max;
+} frame_setting_tags[] = {
+    { "jxl-decoding-speed", JXL_ENC_FRAME_SETTING_DECODING_SPEED, 0, 4 },
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    { "jxl-buffering", JXL_ENC_FRAME_SETTING_BUFFERING, 0, 3 },
+#endif
+    { "jxl-modular", JXL_ENC_FRAME_SETTING_MODULAR, 0, 1 },
+    { "jxl-group-size", JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, 0, 3 },
+    { "jxl-progressive-dc", JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, 0, 2 },
+    { "jxl-progressive-ac", JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, 0, 1 },
+    { "jxl-patches", JXL_ENC_FRAME_SETTING_PATCHES, 0, 1 },
+    { "jxl-dots", JXL_ENC_FRAME_SETTING_DOTS, 0, 1 },
+    { "jxl-gaborish", JXL_ENC_FRAME_SETTING_GABORISH, 0, 1 },
+};
+
+#define NUM_FRAME_SETTING_TAGS (sizeof(frame_setting_tags)/sizeof(frame_setting_tags[0]))
+
+/**
+ * Upper limit for the "jxl-threads" tag.
+ */
+#define SAVE_MAX_THREADS 1024
+
+/**
+ * Encoder settings for save().
+ */
+typedef struct
+{
+    int quality;         ///< 0 to 99, where 99 is lossless, or -1 for libjxl's default
+    int effort;          ///< 1 to 9, or 0 for libjxl's default
+    bool fast_lossless;  ///< Use libjxl's fastest lossless mode, ignoring @c quality and @c effort
+    int frame_settings[NUM_FRAME_SETTING_TAGS];  ///< Values for frame_setting_tags, or -1 for libjxl's default
+    int threads;         ///< Maximum number of threads, counting the calling thread (1 to encode on it alone), or -1 for no limit
+    bool any;            ///< Set if any of the settings were given
+} save_options;
+
+/**
+ * Save options that come from the environment, read once like load_env.
+ */
+static struct
+{
+    pthread_once_t once;
+    bool fast_lossless;
+} save_env = { .once = PTHREAD_ONCE_INIT };
+
+/**
+ * @brief Read the save options that come from the environment.
+ *
+ * - IMLIB2_JXL_FAST_LOSSLESS: 1 to save in the fast lossless mode.  For tools that can't attach tags.
+ */
+static void save_env_init(void)
+{
+    const char *env = getenv("IMLIB2_JXL_FAST_LOSSLESS");
+    save_env.fast_lossless = env && strtoul(env, NULL, 10) != 0;
+}
+
+/**
+ * @brief Read the encoder settings from the tags attached to @p im (and the environment).
+ */
+static void get_save_options(ImlibImage *im, save_options *opts)
+{
+    const ImlibImageTag *tag;
+
+    *opts = (save_options){ .quality = -1, .effort = 0, .threads = -1 };
+
+    if((tag = __imlib_GetTag(im, "quality")))
+    {
+        // Other loaders seem to assume that quality is in the range [0-99] (?)
+        opts->quality = (tag->val < 0) ? 0 :
+                        (tag->val > 99) ? 99 :
+                         tag->val;
+        opts->any = true;
+    }
+
+    if((tag = __imlib_GetTag(im, "compression")))
+    {
+        // Other loaders seem to assume that compression is in the range [0-9] (?)
+        // libjxl works with [1-9]
+        opts->effort = (tag->val < 1) ? 1 :
+                       (tag->val > 9) ? 9 :
+                        tag->val;
+        opts->any = true;
+    }
+
+    pthread_once(&save_env.once, save_env_init);
+    if(((tag = __imlib_GetTag(im, "jxl-fast-lossless")) && tag->val) || save_env.fast_lossless)
+    {
+        opts->fast_lossless = true;
+        opts->any = true;
+    }
+
+    for(size_t i = 0; i < NUM_FRAME_SETTING_TAGS; ++i)
+    {
+        opts->frame_settings[i] = -1;
+        if((tag = __imlib_GetTag(im, frame_setting_tags[i].tag)))
+        {
+            opts->frame_settings[i] = (tag->val < frame_setting_tags[i].min) ? frame_setting_tags[i].min :
+                                      (tag->val > frame_setting_tags[i].max) ? frame_setting_tags[i].max :
+                                       tag->val;
+            opts->any = true;
+        }
+    }
+
+    // The number of threads doesn't change the output, so it doesn't count as a setting for passthrough
+    if((tag = __imlib_GetTag(im, "jxl-threads")))
+    {
+        opts->threads = (tag->val < 1) ? 1 :
+                        (tag->val > SAVE_MAX_THREADS) ? SAVE_MAX_THREADS :
+                         tag->val;
+    }
+}
+
+
+/* Passthrough
+ *
+ * When asked to (it costs a copy of the file and a pass over the pixels), an image loaded in full keeps
+ * the original file with it in a tag, along with a checksum of the decoded pixels.  If it's saved again with the pixels unchanged and no encoder settings, the
+ * original file is written back instead of re-encoding: that's much faster, and doesn't lose quality
+ * when the original was lossy.
+ */
+
+/**
+ * Key of the tag holding the original file.
+ */
+#define SOURCE_TAG "jxl-source"
+
+/**
+ * The original file an image was loaded from, and what the image looked like at the time.
+ */
+typedef struct
+{
+    uint64_t checksum;  ///< checksum_pixels() of the image as loaded
+    int w, h;
+    int has_alpha;
+    size_t size;
+    uint8_t bytes[];    ///< The whole file
+} jxl_source;
+
+/**
+ * @brief Checksum a block of ARGB pixels, to detect whether they've changed since loading.
+ *
+ * Works on 64-bit words in four independent lanes, so it runs at close to memory speed.
+ */
+static uint64_t checksum_pixels(const uint32_t *data, size_t num_pixels)
+{
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = { HASH_INIT, HASH_INIT ^ 1, HASH_INIT ^ 2, HASH_INIT ^ 3 };
+    const uint8_t *bytes = (const uint8_t*)data;
+    const size_t size = num_pixels * sizeof(*data);
+    size_t i = 0;
+
+    for(; i + 32 <= size; i += 32)
+    {
+        for(int lane = 0; lane < 4; ++lane)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * 8, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+
+    uint64_t hash = hash_bytes(HASH_INIT, lanes, sizeof(lanes));
+    hash = hash_bytes(hash, bytes + i, size - i);
+    return hash_bytes(hash, &size, sizeof(size));
+}
+
+static void source_tag_free(ImlibImage *im, void *data)
+{
+    (void)im;
+    free(data);
+}
+
+/**
+ * @brief Keep a copy of the file @p im was loaded from, so save_passthrough() can write it back.
+ *
+ * Failure isn't an error: the image will just be re-encoded if saved.
+ */
+static void source_tag_attach(ImlibImage *im, const uint8_t *input, size_t input_size)
+{
+    jxl_source *source;
+    if(!(source = malloc(sizeof(*source) + input_size)))
+    {
+        WARN_PRINTF("Failed to allocate %zu B to keep the original file", input_size);
+        return;
+    }
+
+    source->checksum = checksum_pixels(im->data, (size_t)im->w * im->h);
+    source->w = im->w;
+    source->h = im->h;
+    source->has_alpha = im->has_alpha;
+    source->size = input_size;
+    memcpy(source->bytes, input, input_size);
+    __imlib_AttachTag(im, SOURCE_TAG, 0, source, source_tag_free);
+}
+
+/**
+ * @brief Write the original file back if @p im is unchanged since it was loaded.
+ *
+ * @param[in] im The image being saved.
+ * @param[in] opts Encoder settings for the image.  If there are any, it's always re-encoded.
+ * @param[in,out] timing Measurements of the save.
+ *
+ * @return 1 if the original file was written, 0 if the image needs encoding, or -1 if writing failed.
+ */
+static int save_passthrough(ImlibImage *im, const save_options *opts, call_timing *timing)
+{
+    const ImlibImageTag *tag = __imlib_GetTag(im, SOURCE_TAG);
+    if(!tag || !tag->data)
+        return 0;
+
+    if(opts->any)
+    {
+        DEBUG_PRINTF("Re-encoding because encoder settings were given");
+        return 0;
+    }
+
+    const jxl_source *source = tag->data;
+    if(source->w != im->w || source->h != im->h || source->has_alpha != im->has_alpha ||
+       source->checksum != checksum_pixels(im->data, (size_t)im->w * im->h))
+    {
+        DEBUG_PRINTF("Re-encoding because the image has changed");
+        return 0;
+    }
+
+    const uint64_t started = timing_now(timing);
+    if(fwrite(source->bytes, 1, source->size, im->fi->fp) != source->size)
+    {
+        WARN_PRINTF("Failed to write %zu B", source->size);
+        return -1;
+    }
+    timing_end_phase(timing, PHASE_WRITE, started);
+    timing->bytes = source->size;
+    DEBUG_PRINTF("Wrote back the original %zu B", source->size);
+    STATS_INC(passthrough_saves);
+    return 1;
+}
+
+
+/**
+ * @brief Do the work of load().
+ *
+ * @param[in] use_keyframes Whether an animation frame may be decoded from a keyframe listed in the
+ *                          file's jxli box.  If that fails, the load is done again without.
+ */
+static int load_internal(ImlibImage* im, int load_data, bool use_keyframes)
+{
+    DEBUG_PRINTF("Load [%s][%zu]", im->fi->name, (size_t)im->fi->fsize);
+
+    int retval = LOAD_FAIL;
+    pooled_decoder *pd = NULL;
+    JxlDecoder *dec = NULL;
+    void *runner = NULL;
+    decode_target target = { .data = NULL };
+    load_options opts;
+    call_timing timing;
+    uint64_t decode_start = 0;
+    bool use_preview = false;
+    uint8_t *preview_pixels = NULL;
+#ifdef FF_IMAGE_ANIMATED
+    ImlibImageFrame *pf = NULL;
+    const int frame = im->frame; // 0 unless imlib2 is asking for a particular frame
+    int frame_count = 1;
+    size_t frames_skipped = 0;      // Frames before the start of the input, if starting from a keyframe
+    uint8_t *spliced_input = NULL;
+    bool retry_from_start = false;  // Set if starting from a keyframe failed
+#else
+    const int frame = 0;
+    (void)use_keyframes;
+#endif
+
+    const uint8_t *input = im->fi->fdata;
+    size_t input_size = im->fi->fsize;
+
+#ifdef IMLIB2JXL_USE_LCMS
+    uint8_t *icc_blob = NULL;
+    size_t icc_size = 0;
+    int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE | JXL_DEC_COLOR_ENCODING;
+#else
+    int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
+#endif
+
+    // imlib2 offers us files that may not be JXL at all, so check the signature before setting anything up
+    // (A file too short to tell starts like a JXL file as far as it goes, so it's a truncated one.)
+    const JxlSignature sig = JxlSignatureCheck(input, input_size);
+    if(sig == JXL_SIG_INVALID)
+    {
+        DEBUG_PRINTF("Not a JPEG XL file");
+        return LOAD_FAIL;
+    }
+    if(sig == JXL_SIG_NOT_ENOUGH_BYTES)
+    {
+        DEBUG_PRINTF("JPEG XL file truncated in its signature");
+        return LOAD_BADIMAGE;
+    }
+
+    timing_begin(&timing);
+    timing.bytes = input_size;
+    get_load_options(im, &opts);
+
+    // If imlib2 only wants the metadata, the basic info is all we need, and there's no decoding to
+    // share between threads.
+    if(!load_data)
+        events = JXL_DEC_BASIC_INFO;
+    else if(opts.preview_size > 0 && opts.crop_w == 0)
+        events |= JXL_DEC_PREVIEW_IMAGE;
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,7,0)
+    // Progressive passes are where a reduced-size load can stop
+    if(load_data && opts.scale > 1)
+        events |= JXL_DEC_FRAME_PROGRESSION;
+#endif
+#ifdef FF_IMAGE_ANIMATED
+    // The frame header of the requested frame gives its duration
+    if(load_data && frame > 0)
+        events |= JXL_DEC_FRAME;
+
+    // Find out how many frames there are, which imlib2 wants even from a header-only load, and
+    // whether decoding can start from a keyframe nearer the requested frame than the first one.
+    // Counting only walks the frame headers, and it's remembered, so the load of the pixels that
+    // follows doesn't do it again.  A plain load (frame 0) doesn't need the count at all.
+    frame_restart restart = { .header_size = 0 };
+    if(frame > 0)
+    {
+        if(frame_index_lookup(im->fi->name, im->fi->fp, input, input_size, frame, &frame_count, &restart))
+            RETURN_ERR(LOAD_BADIMAGE, "Failed to read frame headers");
+        if(frame > frame_count)
+            RETURN_ERR(LOAD_BADFRAME, "Requested frame %d of %d", frame, frame_count);
+    }
+
+    if(frame > 0 && load_data)
+    {
+        // During playback, take frames from a background decoder that keeps ahead of the viewer.
+        // That's also where the canvas lives if we're composing frames ourselves.
+        if((opts.prefetch > 0 || !opts.coalesce) && frame_count > 1 && opts.scale == 1 && opts.crop_w == 0)
+        {
+            if(prefetch_get(im, input, input_size, frame, frame_count, opts.prefetch, opts.coalesce) == 0)
+            {
+                if(im->lc)
+                    __imlib_LoadProgressRows(im, 0, im->h);
+                retval = LOAD_SUCCESS;
+                goto ret;
+            }
+            DEBUG_PRINTF("Prefetch failed; decoding frame %d directly", frame);
+        }
+
+        if(use_keyframes && restart.header_size > 0)
+        {
+            // Give the decoder the headers followed directly by the keyframe
+            const size_t spliced_size = restart.header_size + restart.size;
+            if(!(spliced_input = malloc(spliced_size)))
+                RETURN_ERR(LOAD_OOM, "Failed to allocate %zu B", spliced_size);
+            memcpy(spliced_input, restart.codestream, restart.header_size);
+            memcpy(spliced_input + restart.header_size, restart.codestream + restart.offset, restart.size);
+            input = spliced_input;
+            input_size = spliced_size;
+            frames_skipped = restart.frame;
+            DEBUG_PRINTF("Starting from keyframe %zu", restart.frame);
+        }
+    }
+#endif
+
+    // Initialize decoder
+    if(!(pd = decoder_acquire()))
+        RETURN_ERR(LOAD_FAIL, "Failed to get a decoder");
+    dec = pd->dec;
+
+    if(load_data)
+    {
+        if(!(runner = runner_acquire(-1)))
+            RETURN_ERR(LOAD_FAIL, "Failed to get a thread runner");
+
+        if(JxlDecoderSetParallelRunner(dec, pool_run, runner) != JXL_DEC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetParallelRunner");
+    }
 
     if(JxlDecoderSubscribeEvents(dec, events) != JXL_DEC_SUCCESS)
         RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSubscribeEvents");
 
-    if(JxlDecoderSetInput(dec, (const uint8_t*)im->fi->fdata, im->fi->fsize) != JXL_DEC_SUCCESS)
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,7,0)
+    // For a reduced size image, we can stop as soon as a pass at (at least) that resolution is available.
+    // The DC alone is 1/8 resolution.
+    if(events & JXL_DEC_FRAME_PROGRESSION)
+    {
+        if(JxlDecoderSetProgressiveDetail(dec, opts.scale == 8 ? kDC : kPasses) != JXL_DEC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetProgressiveDetail");
+    }
+#endif
+
+    // The whole file is in memory, so hand it all over at once
+    if(JxlDecoderSetInput(dec, input, input_size) != JXL_DEC_SUCCESS)
         RETURN_ERR(LOAD_BADIMAGE, "Failed in JxlDecoderSetInput");
+    JxlDecoderCloseInput(dec);
 
-    
     // Start decoding
-    size_t num_pixels = 0;
-    size_t pixels_size = 0; // Total size of raw pixels in bytes
     JxlDecoderStatus res;
     JxlBasicInfo basic_info;
     JxlPixelFormat pixel_format = {
@@ -335,7 +4718,9 @@ static int load(ImlibImage* im, int load_data)
                                     .align = 0
                                   };
 
-    while((res = JxlDecoderProcessInput(dec)) != JXL_DEC_FULL_IMAGE)
+    bool finished_early = false; // Set if a progressive pass or the preview was good enough to stop early
+
+    while(!finished_early && (res = JxlDecoderProcessInput(dec)) != JXL_DEC_FULL_IMAGE)
     {
         switch(res)
         {
@@ -343,18 +4728,77 @@ static int load(ImlibImage* im, int load_data)
 
             if((res = JxlDecoderGetBasicInfo(dec, &basic_info)) != JXL_DEC_SUCCESS)
                 RETURN_ERR(LOAD_BADIMAGE, "Failed in JxlDecoderGetBasicInfo");
+            timing_end_phase(&timing, PHASE_HEADER, timing.start);
+            decode_start = timing_now(&timing);
 
             DEBUG_PRINTF("%ux%u RGB%s", basic_info.xsize, basic_info.ysize, basic_info.alpha_bits>0 ? "A" : "");
 
-            if(!IMAGE_DIMENSIONS_OK(basic_info.xsize, basic_info.ysize))
-                RETURN_ERR(LOAD_BADIMAGE, "Dimensions %ux%u are not supported by imlib2", basic_info.xsize, basic_info.ysize);
+            // If the caller wants a thumbnail no larger than the preview, that's all we need to decode
+            if(opts.preview_size > 0 && opts.crop_w == 0 && basic_info.have_preview && frame <= 1 &&
+               basic_info.preview.xsize >= opts.preview_size && basic_info.preview.ysize >= opts.preview_size)
+            {
+                DEBUG_PRINTF("Using %ux%u preview", basic_info.preview.xsize, basic_info.preview.ysize);
+                use_preview = true;
+                im->w = basic_info.preview.xsize;
+                im->h = basic_info.preview.ysize;
+            }
+            else
+            {
+                // The region of the image we'll keep
+                target.x0 = 0;
+                target.y0 = 0;
+                target.x1 = basic_info.xsize;
+                target.y1 = basic_info.ysize;
+                if(opts.crop_w > 0)
+                {
+                    if(opts.crop_x >= basic_info.xsize || opts.crop_y >= basic_info.ysize)
+                        RETURN_ERR(LOAD_BADIMAGE, "Crop region is outside the %ux%u image", basic_info.xsize, basic_info.ysize);
+                    target.x0 = opts.crop_x;
+                    target.y0 = opts.crop_y;
+                    if(opts.crop_w < target.x1 - target.x0)
+                        target.x1 = target.x0 + opts.crop_w;
+                    if(opts.crop_h < target.y1 - target.y0)
+                        target.y1 = target.y0 + opts.crop_h;
+                    DEBUG_PRINTF("Cropping to %zux%zu+%zu+%zu", target.x1 - target.x0, target.y1 - target.y0, target.x0, target.y0);
+                }
+                im->w = (target.x1 - target.x0 + opts.scale - 1) / opts.scale;
+                im->h = (target.y1 - target.y0 + opts.scale - 1) / opts.scale;
+            }
+
+            // Only the size we'll actually produce has to suit imlib2, so a crop of a huge image is fine
+            if(!IMAGE_DIMENSIONS_OK(im->w, im->h))
+                RETURN_ERR(LOAD_BADIMAGE, "Dimensions %dx%d are not supported by imlib2", im->w, im->h);
+
+            // Don't spread a small image over more threads than it can keep busy.  A crop still decodes
+            // the whole image.
+            if(use_preview)
+                runner_fit_image(runner, basic_info.preview.xsize, basic_info.preview.ysize);
+            else
+                runner_fit_image(runner, basic_info.xsize, basic_info.ysize);
 
-            im->w = basic_info.xsize;
-            im->h = basic_info.ysize;
-            num_pixels = basic_info.xsize * basic_info.ysize;
             im->has_alpha = basic_info.alpha_bits > 0;
             pixel_format.num_channels = ((basic_info.num_color_channels >= 3) ? 3 : 1) + (basic_info.alpha_bits > 0);
-            
+
+#ifdef FF_IMAGE_ANIMATED
+            // Describe the animation if imlib2 is asking for a particular frame, then skip straight to
+            // that frame.  libjxl only renders skipped frames that the requested one depends on.
+            if(frame > 0)
+            {
+                if(!(pf = __imlib_GetFrame(im)))
+                    RETURN_ERR(LOAD_OOM, "Failed in __imlib_GetFrame");
+                pf->canvas_w = im->w;
+                pf->canvas_h = im->h;
+                pf->frame_count = frame_count;
+                if(basic_info.have_animation)
+                {
+                    pf->frame_flags |= FF_IMAGE_ANIMATED;
+                    pf->loop_count = basic_info.animation.num_loops;
+                }
+                if((size_t)frame - 1 > frames_skipped)
+                    JxlDecoderSkipFrames(dec, frame - 1 - frames_skipped);
+            }
+#endif
+
             // If imlib2 only wants the metadata, return now
             if (!load_data)
             {
@@ -366,210 +4810,557 @@ static int load(ImlibImage* im, int load_data)
 
 #ifdef IMLIB2JXL_USE_LCMS
         case JXL_DEC_COLOR_ENCODING:
-        {
-            //if(basic_info.num_color_channels < 3)
-            //{
-            //    /* Converting color profiles for grayscale input is currently broken, so skip for now. */
-            //    DEBUG_PRINTF("Ignored color encoding for grayscale image");
-            //    break;
-            //}
-
-            // If the decoder can produce srgb, it should.
-            //JxlDecoderSetCms(); // not implemented in libjxl yet
-            JxlColorEncoding srgb;
-            JxlColorEncodingSetToSRGB(&srgb, /*is_gray=*/basic_info.num_color_channels == 1);
-            if(JxlDecoderSetPreferredColorProfile(dec, &srgb) != JXL_DEC_SUCCESS)
-                WARN_PRINTF("Cannot set preferred output color profile");
-
-            /* If libjxl claims the decoded pixels will be RGB/sRGB, don't bother converting anything.
-             * If there's no JPEG-XL-encoded profile, or it's something other than sRGB, try to
-             * extract an ICC profile and save it for later. */
-
-            JxlColorEncoding color_enc;
-            if(IMLIB2_JXL_GET_ENCODED_PROFILE(dec, JXL_COLOR_PROFILE_TARGET_DATA, &color_enc) == JXL_DEC_SUCCESS)
-            {
-
-                if((color_enc.color_space == JXL_COLOR_SPACE_RGB || color_enc.color_space == JXL_COLOR_SPACE_GRAY)
-                   &&
-                   /* Transfer function is IEC sRGB */
-                   color_enc.transfer_function == JXL_TRANSFER_FUNCTION_SRGB
-                   &&
-                   (color_enc.color_space == JXL_COLOR_SPACE_GRAY ||
-                     (
-                       /* Primaries are CIE sRGB or close enough */
-                       color_enc.primaries == JXL_PRIMARIES_SRGB ||
-                       (color_enc.primaries == JXL_PRIMARIES_CUSTOM &&
-                         near_equal(2, color_enc.primaries_red_xy, srgb.primaries_red_xy) &&
-                         near_equal(2, color_enc.primaries_green_xy, srgb.primaries_green_xy) &&
-                         near_equal(2, color_enc.primaries_blue_xy, srgb.primaries_blue_xy)
-                       )
-                     )
-                   )
-                   &&
-                   (
-                    /* White point is, or could pass for, D65 */
-                     color_enc.white_point == JXL_WHITE_POINT_D65 ||
-                    (color_enc.white_point == JXL_WHITE_POINT_CUSTOM && near_equal(2, color_enc.white_point_xy, srgb.white_point_xy))
-                   )
-                  )
-                {
-                    DEBUG_PRINTF("Encoded color profile is %s %ssRGB/D65",
-                                 color_enc.transfer_function == JXL_TRANSFER_FUNCTION_SRGB &&
-                                 color_enc.white_point == JXL_WHITE_POINT_D65
-                                 ? "exactly" : "nearly",
-                                 color_enc.color_space == JXL_COLOR_SPACE_GRAY ? "(gray) " : "");
-                    break;
-                }
-            }
+            if(get_color_profile(dec, basic_info.num_color_channels == 1, &icc_blob, &icc_size))
+                RETURN_ERR(LOAD_OOM, "Failed to get color profile");
+            break;
+#endif // IMLIB2JXL_USE_LCMS
 
-            if(IMLIB2_JXL_GET_ICC_PROFILE_SIZE(dec, JXL_COLOR_PROFILE_TARGET_DATA, &icc_size) != JXL_DEC_SUCCESS)
+#ifdef FF_IMAGE_ANIMATED
+        case JXL_DEC_FRAME:
+        {
+            // Because of the skip, this is the frame that was asked for
+            JxlFrameHeader frame_header;
+            if(JxlDecoderGetFrameHeader(dec, &frame_header) != JXL_DEC_SUCCESS)
+                RETURN_ERR(LOAD_BADIMAGE, "Failed in JxlDecoderGetFrameHeader");
+            if(pf && basic_info.have_animation && basic_info.animation.tps_numerator > 0)
             {
-                icc_size = 0;
-                break;
+                pf->frame_delay = (uint64_t)frame_header.duration * 1000 * basic_info.animation.tps_denominator
+                                  / basic_info.animation.tps_numerator;
             }
+            break;
+        }
+#endif
 
-            if(!(icc_blob = malloc(icc_size)))
-                RETURN_ERR(LOAD_OOM, "Failed to allocate %zu B for ICC profile", icc_size);
+        case JXL_DEC_NEED_PREVIEW_OUT_BUFFER:
+        {
+            // Previews are small, so take the whole thing in one buffer and convert it afterwards.
+            // (If the preview turned out to be too small to use, it's decoded anyway and discarded.)
+            size_t preview_size;
+            if(JxlDecoderPreviewOutBufferSize(dec, &pixel_format, &preview_size) != JXL_DEC_SUCCESS)
+                RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderPreviewOutBufferSize");
+            if(!(preview_pixels = malloc(preview_size)))
+                RETURN_ERR(LOAD_OOM, "Failed to allocate %zu B for preview", preview_size);
+            if(JxlDecoderSetPreviewOutBuffer(dec, &pixel_format, preview_pixels, preview_size) != JXL_DEC_SUCCESS)
+                RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetPreviewOutBuffer");
+            break;
+        }
 
-            if(IMLIB2_JXL_GET_ICC_PROFILE(dec, JXL_COLOR_PROFILE_TARGET_DATA, icc_blob, icc_size) != JXL_DEC_SUCCESS)
+        case JXL_DEC_PREVIEW_IMAGE:
+            if(use_preview)
             {
-                WARN_PRINTF("Failed to read ICC profile");
-                free(icc_blob);
-                icc_blob = NULL;
-                icc_size = 0;
-                break;
+                if(!__imlib_AllocateData(im))
+                    RETURN_ERR(LOAD_OOM, "Failed in __imlib_AllocateData");
+                const uint64_t started = timing_now(&timing);
+                swizzle_to_argb(im->data, preview_pixels, (size_t)im->w * im->h, pixel_format.num_channels);
+                timing_end_phase(&timing, PHASE_SWIZZLE, started);
+                finished_early = true;
             }
-
-            DEBUG_PRINTF("Got ICC color profile");
+            free(preview_pixels);
+            preview_pixels = NULL;
             break;
-        }
-#endif // IMLIB2JXL_USE_LCMS
 
         case JXL_DEC_NEED_IMAGE_OUT_BUFFER:
-            // Time to allocate some space for the pixels
-            if (JxlDecoderImageOutBufferSize(dec, &pixel_format, &pixels_size) != JXL_DEC_SUCCESS )
-                RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderImageOutBufferSize");
+            // Time to allocate some space for the pixels.  libjxl hands them over via the callback,
+            // which writes them straight into im->data.
+            if(!__imlib_AllocateData(im))
+                RETURN_ERR(LOAD_OOM, "Failed in __imlib_AllocateData");
 
-            // Sanity check
-            if (pixels_size != (size_t)basic_info.xsize * basic_info.ysize * pixel_format.num_channels)
-                RETURN_ERR(LOAD_FAIL, "Pixel buffer size is %zu, but expected (%u * %u * %u) = %zu",
-                           pixels_size, basic_info.xsize, basic_info.ysize, pixel_format.num_channels,
-                           (size_t)basic_info.xsize * basic_info.ysize * pixel_format.num_channels);
+            target.data = im->data;
+            target.width = im->w;
+            target.num_channels = pixel_format.num_channels;
+            target.scale = opts.scale;
+            target.timing = &timing;
+
+            // At full size, each row can be reported as soon as libjxl has delivered all of it
+            if(im->lc && opts.scale == 1 && !target.row_pixels)
+            {
+                if(!(target.row_pixels = calloc(im->h, sizeof(*target.row_pixels))))
+                    RETURN_ERR(LOAD_OOM, "Failed to allocate progress counters");
+                target.im = im;
+                target.caller = pthread_self();
+                target.full_width = basic_info.xsize;
+                target.runner = runner;
+#ifdef IMLIB2JXL_USE_LCMS
+                target.icc_blob = icc_blob;
+                target.icc_size = icc_size;
+#endif
+            }
 
-            if (!(target = malloc(pixels_size * sizeof(uint8_t))))
-                RETURN_ERR(LOAD_OOM, "Failed to allocate %zu B for pixels", pixels_size);
+            if (JxlDecoderSetImageOutCallback(dec, &pixel_format, decode_image_out, &target) != JXL_DEC_SUCCESS)
+                RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetImageOutCallback");
 
-            if (JxlDecoderSetImageOutBuffer(dec, &pixel_format, target, pixels_size) != JXL_DEC_SUCCESS)
-                RETURN_ERR(LOAD_FAIL, "Failed in JxlDecoderSetImageOutBuffer");
+            break;
 
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,7,0)
+        case JXL_DEC_FRAME_PROGRESSION:
+        {
+            const size_t ratio = JxlDecoderGetIntendedDownsamplingRatio(dec);
+            DEBUG_PRINTF("Progressive pass at 1/%zu resolution", ratio);
+            if(ratio > 1 && ratio <= opts.scale)
+            {
+                // Have libjxl render what it has (upsampled to full size) through the callback,
+                // which picks out the pixels we need.
+                if(JxlDecoderFlushImage(dec) == JXL_DEC_SUCCESS)
+                    finished_early = true;
+                else
+                {
+                    DEBUG_PRINTF("Failed in JxlDecoderFlushImage; continuing to full resolution");
+                }
+            }
             break;
+        }
+#endif
 
         case JXL_DEC_NEED_MORE_INPUT:
             RETURN_ERR(LOAD_BADIMAGE, "Input truncated");
 
         case JXL_DEC_ERROR:
-        {
-            JxlSignature sig = JxlSignatureCheck((uint8_t*)im->fi->fdata, im->fi->fsize);
-            RETURN_ERR(LOAD_BADIMAGE, "Error while decoding: %s", (sig == JXL_SIG_CODESTREAM || sig == JXL_SIG_CONTAINER) ? "corrupted file?" : "not a JPEG XL file!");
-        }
+            // Cancelling the runner is how the progress callback stops the decode
+            if(target.cancelled)
+            {
+                retval = LOAD_BREAK;
+                goto ret;
+            }
+#ifdef FF_IMAGE_ANIMATED
+            // If the jxli box led to something that isn't a keyframe, decode from the start instead
+            if(spliced_input)
+            {
+                WARN_PRINTF("Failed to decode from keyframe %zu; starting again from the first frame", frames_skipped);
+                frame_index_forget_keyframes(im->fi->name, im->fi->fp, im->fi->fdata, im->fi->fsize);
+                retry_from_start = true;
+            }
+#endif
+            RETURN_ERR(LOAD_BADIMAGE, "Error while decoding: corrupted file?");
 
         default:
             RETURN_ERR(LOAD_FAIL, "Unexpected result from JxlDecoderProcessInput");
       }
 
     }
+    timing_end_phase(&timing, PHASE_DECODE, decode_start);
+
+    // The last pieces may have arrived on worker threads, after the loading thread's last report
+    if(target.row_pixels)
+        decode_report_rows(&target);
+    if(target.cancelled)
+    {
+        retval = LOAD_BREAK;
+        goto ret;
+    }
+
+#ifdef IMLIB2JXL_USE_LCMS
+    // The callback has already stored the pixels as ARGB, so the color space transformation
+    // (if there is one) can work in place.  Rows that have been reported are already done.
+    if(icc_size > 0 && target.rows_done < im->h)
+    {
+        const uint64_t started = timing_now(&timing);
+        if(convert_to_srgb(icc_blob, icc_size, im->data + (size_t)target.rows_done * im->w, im->w,
+                           im->h - target.rows_done, pixel_format.num_channels, runner))
+            WARN_PRINTF("Color space transformation failed, but continuing anyway");
+        timing_end_phase(&timing, PHASE_COLOR, started);
+    }
+#endif
+
+    if(im->lc && target.rows_done < im->h)
+        __imlib_LoadProgressRows(im, target.rows_done, im->h - target.rows_done);
 
-    // Allocate buffer for im->data
-    if(!__imlib_AllocateData(im))
-        RETURN_ERR(LOAD_OOM, "Failed in __imlib_AllocateData");
+    // Keep the original file if asked to, and the image is exactly what it encodes, so an unmodified
+    // image can be saved again without re-encoding
+    if(opts.passthrough && frame == 0 && !basic_info.have_animation && !use_preview && target.scale == 1 &&
+       (size_t)im->w == basic_info.xsize && (size_t)im->h == basic_info.ysize)
+        source_tag_attach(im, input, input_size);
 
-    // Data from libjxl is byte-ordered RGBA, so now have to swap the channels around for imlib2
-    // ...but if we're doing a color space transformation, we can swap channels at the same time, so
-    // there's no need to do two passes.
+    retval = LOAD_SUCCESS;
 
+ret:
 #ifdef IMLIB2JXL_USE_LCMS
-    bool color_converted = false;
+    free(icc_blob);
+#endif
+    free(target.row_pixels);
+    free(preview_pixels);
+#ifdef FF_IMAGE_ANIMATED
+    free(spliced_input);
+#endif
+    if(pd && load_data)
+        mem_report(&pd->memory, "load");
+    if(im->data)
+        timing.pixels = (size_t)im->w * im->h;
+    timing_report(&timing, "load", TIMING_LOAD_PHASES, retval,
+                  pd ? atomic_load_explicit(&pd->memory.peak, memory_order_relaxed) : 0, im->fi->name);
+    decoder_release(pd);
+    runner_release(runner);
+
+#ifdef FF_IMAGE_ANIMATED
+    if(retry_from_start)
+    {
+        __imlib_FreeData(im);
+        return load_internal(im, load_data, false);
+    }
+#endif
+
+  return retval;
+}
+
+static int load(ImlibImage* im, int load_data)
+{
+    return load_internal(im, load_data, true);
+}
+
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+/**
+ * Size of the buffer libjxl writes encoded bytes into.  Each time it's filled, it's written straight
+ * to the file.
+ */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Alignment of the output buffer (and of its size).
+ */
+#define OUTPUT_BUFFER_ALIGN 4096
+
+/**
+ * State of the output processor that streams encoded bytes to the file being saved.
+ */
+typedef struct
+{
+    int fd;             ///< Descriptor of the file being saved
+    off_t base;         ///< Offset in the file of the start of the JPEG XL data
+    bool seekable;      ///< Whether @c fd can be written at arbitrary positions
+    uint64_t position;  ///< Where the next bytes go, relative to @c base
+    uint64_t end;       ///< End of the data written so far, relative to @c base
+    uint8_t *buffer;
+    size_t buffer_size;
+    bool failed;        ///< Set if anything went wrong, since the callbacks can't report errors
+    call_timing *timing;
+} output_stream;
+
+static void *output_get_buffer(void *opaque, size_t *size)
+{
+    output_stream *stream = opaque;
 
-    if(icc_size > 0)
+    if(!stream->buffer || *size > stream->buffer_size)
     {
-        // Reinterpret im->data as a uint8_t*, which is unportable,
-        // but awfully convenient when uint8_t == unsigned char.
-        if(convert_to_srgb(icc_blob, icc_size, target, (uint8_t*)(im->data),
-                           num_pixels, pixel_format.num_channels))
+        size_t new_size = (*size > OUTPUT_BUFFER_SIZE) ? *size : OUTPUT_BUFFER_SIZE;
+        new_size = (new_size + OUTPUT_BUFFER_ALIGN - 1) / OUTPUT_BUFFER_ALIGN * OUTPUT_BUFFER_ALIGN;
+        void *buffer;
+        if(posix_memalign(&buffer, OUTPUT_BUFFER_ALIGN, new_size) != 0)
         {
-            WARN_PRINTF("Color space transformation failed, but continuing anyway");
+            WARN_PRINTF("Failed to allocate %zu B output buffer", new_size);
+            stream->failed = true;
+            *size = 0;
+            return NULL;
         }
-        else
+        free(stream->buffer);
+        stream->buffer = buffer;
+        stream->buffer_size = new_size;
+    }
+
+    *size = stream->buffer_size;
+    return stream->buffer;
+}
+
+static void output_release_buffer(void *opaque, size_t written_bytes)
+{
+    output_stream *stream = opaque;
+    const uint8_t *data = stream->buffer;
+    const uint64_t started = timing_now(stream->timing);
+
+    while(written_bytes > 0 && !stream->failed)
+    {
+        const ssize_t n = stream->seekable ? pwrite(stream->fd, data, written_bytes, stream->base + stream->position)
+                                           : write(stream->fd, data, written_bytes);
+        if(n < 0)
         {
-            color_converted = true;
+            if(errno == EINTR)
+                continue;
+            WARN_PRINTF("Failed to write %zu B: %s", written_bytes, strerror(errno));
+            stream->failed = true;
+            break;
         }
+        data += n;
+        written_bytes -= n;
+        stream->position += n;
     }
+    if(stream->position > stream->end)
+        stream->end = stream->position;
+    timing_end_phase(stream->timing, PHASE_WRITE, started);
+}
+
+static void output_seek(void *opaque, uint64_t position)
+{
+    output_stream *stream = opaque;
+    stream->position = position;
+}
+
+static void output_set_finalized_position(void *opaque, uint64_t finalized_position)
+{
+    // Everything is written to the file as soon as libjxl releases it, so there's nothing to do.
+    (void)opaque;
+    (void)finalized_position;
+}
+
+
+/**
+ * A scratch buffer handed to libjxl by the chunked frame input source.
+ */
+typedef struct chunk_buffer
+{
+    struct chunk_buffer *next;  ///< Next free buffer
+    size_t capacity;            ///< Size of @c data
+    uint8_t *data;
+} chunk_buffer;
+
+/**
+ * Supplies libjxl with rectangles of the image being saved, converted from imlib2's ARGB on demand.
+ *
+ * libjxl asks for rectangles from its worker threads, so there are as many scratch buffers as there
+ * are rectangles in use at once (roughly one per thread).  Released buffers go on a free list to be
+ * reused for the next rectangle.
+ */
+typedef struct
+{
+    const uint32_t *argb;  ///< Image data from imlib2
+    size_t width;          ///< Width of the image in pixels
+    int num_channels;      ///< Channels in the color buffers, as for swizzle_from_argb()
+    pthread_mutex_t lock;
+    chunk_buffer *free;    ///< Buffers not currently held by libjxl
+    chunk_buffer *in_use;  ///< Buffers currently held by libjxl
+    bool failed;           ///< Set if a buffer couldn't be allocated
+    call_timing *timing;
+} chunked_source;
+
+/**
+ * @brief Take a scratch buffer of at least @p size bytes from @p source.
+ *
+ * @return Pointer to the buffer's data, or NULL if it couldn't be allocated.
+ */
+static uint8_t *chunked_source_take(chunked_source *source, size_t size)
+{
+    pthread_mutex_lock(&source->lock);
+
+    chunk_buffer *buffer = source->free;
+    if(buffer)
+        source->free = buffer->next;
+    else if((buffer = malloc(sizeof(*buffer))))
+        *buffer = (chunk_buffer){ .data = NULL };
 
-    if(!color_converted)
+    if(buffer && buffer->capacity < size)
     {
-#endif
-        // Convert byte-ordered data in target to word-ordered ARGB
-        if(pixel_format.num_channels == 4)
-        {   // RGBA
-            for (size_t i=0; i<num_pixels; ++i)
-                im->data[i] = PIXEL_ARGB(target[4*i+3], target[4*i+0], target[4*i+1], target[4*i+2]);
-        }
-        else if(pixel_format.num_channels == 3)
-        {   // RGB
-            for (size_t i=0; i<num_pixels; ++i)
-                im->data[i] = PIXEL_ARGB(255u, target[3*i+0], target[3*i+1], target[3*i+2]);
-        }
-        else if(pixel_format.num_channels == 2)
-        {   // GrayA
-            for (size_t i=0; i<num_pixels; ++i)
-                im->data[i] = PIXEL_ARGB(target[2*i+1], target[2*i], target[2*i], target[2*i]);
+        uint8_t *data = realloc(buffer->data, size);
+        if(data)
+        {
+            buffer->data = data;
+            buffer->capacity = size;
         }
         else
-        {   // Gray
-            for (size_t i=0; i<num_pixels; ++i)
-                im->data[i] = PIXEL_ARGB(255u, target[i], target[i], target[i]);
+        {
+            buffer->next = source->free;
+            source->free = buffer;
+            buffer = NULL;
         }
+    }
 
-#ifdef IMLIB2JXL_USE_LCMS
+    if(buffer)
+    {
+        buffer->next = source->in_use;
+        source->in_use = buffer;
+    }
+    else
+    {
+        WARN_PRINTF("Failed to allocate %zu B for a chunk of the image", size);
+        source->failed = true;
     }
-#endif
 
-    retval = LOAD_SUCCESS;
+    pthread_mutex_unlock(&source->lock);
+    return buffer ? buffer->data : NULL;
+}
 
-ret:
-#ifdef IMLIB2JXL_USE_LCMS
-    free(icc_blob);
-#endif
-    free(target);
-    if(dec)
-        JxlDecoderDestroy(dec);
-    if(runner)
-        JxlThreadParallelRunnerDestroy(runner);
+/**
+ * @brief Free all buffers belonging to @p source.
+ */
+static void chunked_source_free(chunked_source *source)
+{
+    chunk_buffer *lists[] = { source->free, source->in_use };
+    for(size_t i = 0; i < sizeof(lists)/sizeof(lists[0]); ++i)
+    {
+        chunk_buffer *buffer = lists[i];
+        while(buffer)
+        {
+            chunk_buffer *next = buffer->next;
+            free(buffer->data);
+            free(buffer);
+            buffer = next;
+        }
+    }
+    source->free = source->in_use = NULL;
+    pthread_mutex_destroy(&source->lock);
+}
 
-  return retval;
+static void chunked_get_color_pixel_format(void *opaque, JxlPixelFormat *pixel_format)
+{
+    const chunked_source *source = opaque;
+    *pixel_format = (JxlPixelFormat){
+                                        .num_channels = source->num_channels,
+                                        .data_type = JXL_TYPE_UINT8,
+                                        .endianness = JXL_NATIVE_ENDIAN,
+                                        .align = 0
+                                    };
+}
+
+static const void *chunked_get_color_data(void *opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize,
+                                          size_t *row_offset)
+{
+    chunked_source *source = opaque;
+    const size_t stride = xsize * source->num_channels;
+    uint8_t *data;
+
+    if(!(data = chunked_source_take(source, stride * ysize)))
+        return NULL;
+
+    const uint64_t started = timing_now(source->timing);
+    for(size_t y = 0; y < ysize; ++y)
+        swizzle_from_argb(data + y * stride, source->argb + (ypos + y) * source->width + xpos, xsize,
+                          source->num_channels);
+    timing_end_phase(source->timing, PHASE_COPY, started);
+
+    *row_offset = stride;
+    return data;
+}
+
+static void chunked_get_extra_pixel_format(void *opaque, size_t ec_index, JxlPixelFormat *pixel_format)
+{
+    (void)opaque;
+    (void)ec_index;
+    *pixel_format = (JxlPixelFormat){
+                                        .num_channels = 1,
+                                        .data_type = JXL_TYPE_UINT8,
+                                        .endianness = JXL_NATIVE_ENDIAN,
+                                        .align = 0
+                                    };
+}
+
+static const void *chunked_get_extra_data(void *opaque, size_t ec_index, size_t xpos, size_t ypos, size_t xsize,
+                                          size_t ysize, size_t *row_offset)
+{
+    // The only extra channel is alpha.  libjxl normally takes it from the interleaved color buffer,
+    // but supply it separately if asked.
+    chunked_source *source = opaque;
+    uint8_t *data;
+    (void)ec_index;
+
+    if(!(data = chunked_source_take(source, xsize * ysize)))
+        return NULL;
+
+    const uint64_t started = timing_now(source->timing);
+    for(size_t y = 0; y < ysize; ++y)
+    {
+        const uint32_t *src = source->argb + (ypos + y) * source->width + xpos;
+        for(size_t x = 0; x < xsize; ++x)
+            data[y * xsize + x] = src[x] >> 24;
+    }
+    timing_end_phase(source->timing, PHASE_COPY, started);
+
+    *row_offset = xsize;
+    return data;
+}
+
+static void chunked_release_buffer(void *opaque, const void *buf)
+{
+    chunked_source *source = opaque;
+
+    pthread_mutex_lock(&source->lock);
+    for(chunk_buffer **link = &source->in_use; *link; link = &(*link)->next)
+    {
+        chunk_buffer *buffer = *link;
+        if(buffer->data == buf)
+        {
+            *link = buffer->next;
+            buffer->next = source->free;
+            source->free = buffer;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&source->lock);
 }
+#endif
 
 
 static int save(ImlibImage* im)
 {
     int retval = LOAD_FAIL;
+    pooled_encoder *pe = NULL;
     JxlEncoder *enc = NULL;
     void *runner = NULL;
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    output_stream stream = { .fd = -1 };
+    chunked_source source = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#else
     uint8_t *pixels = NULL;
     uint8_t *jxl_bytes = NULL;
+#endif
+    FILE* const out = im->fi->fp;
+    save_options opts;
+    call_timing timing;
+    uint64_t started;
+
+    timing_begin(&timing);
+    timing.pixels = (size_t)im->w * im->h;
+    get_save_options(im, &opts);
+
+    switch(save_passthrough(im, &opts, &timing))
+    {
+    case 1:
+        retval = LOAD_SUCCESS;
+        goto ret;
+    case -1:
+        goto ret;
+    }
 
     // Initialize encoder
-    if(!(enc = JxlEncoderCreate(NULL)))
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderCreate");
+    if(!(pe = encoder_acquire()))
+        RETURN_ERR(LOAD_FAIL, "Failed to get an encoder");
+    enc = pe->enc;
+
+    // Limit the number of threads if asked.  With only one, libjxl does all the work on this thread.
+    if(opts.threads != 1)
+    {
+        if(!(runner = runner_acquire(opts.threads)))
+            RETURN_ERR(LOAD_FAIL, "Failed to get a thread runner");
+        runner_fit_image(runner, im->w, im->h);
 
-    if(!(runner = JxlThreadParallelRunnerCreate(NULL, JxlThreadParallelRunnerDefaultNumWorkerThreads())))
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlThreadParallelRunnerCreate");
+        if(JxlEncoderSetParallelRunner(enc, pool_run, runner) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetParallelRunner");
+    }
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    // Have libjxl hand over the encoded bytes as it produces them, and write them straight to the file.
+    // If the file is seekable, libjxl can go back and fill in sections it couldn't write in order.
+    if(fflush(out) != 0)
+        RETURN_ERR(LOAD_FAIL, "Failed to flush output file");
+    stream.fd = fileno(out);
+    stream.timing = &timing;
+    stream.buffer = pe->buffer;
+    stream.buffer_size = pe->buffer_size;
+    pe->buffer = NULL;
+    stream.base = lseek(stream.fd, 0, SEEK_CUR);
+    stream.seekable = (stream.base != -1);
+    if(!stream.seekable)
+        stream.base = 0;
 
-    if(JxlEncoderSetParallelRunner(enc, JxlThreadParallelRunner, runner) != JXL_ENC_SUCCESS)
-        RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetParallelRunner");
+    struct JxlEncoderOutputProcessor output_processor = {
+                                                            .opaque = &stream,
+                                                            .get_buffer = output_get_buffer,
+                                                            .release_buffer = output_release_buffer,
+                                                            .seek = stream.seekable ? output_seek : NULL,
+                                                            .set_finalized_position = output_set_finalized_position
+                                                        };
+    if(JxlEncoderSetOutputProcessor(enc, output_processor) != JXL_ENC_SUCCESS)
+        RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetOutputProcessor");
+#endif
 
-    JxlEncoderFrameSettings *opts;
-    if(!(opts = JxlEncoderFrameSettingsCreate(enc, NULL)))
+    JxlEncoderFrameSettings *frame_opts;
+    if(!(frame_opts = JxlEncoderFrameSettingsCreate(enc, NULL)))
         RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderFrameSettingsCreate");
 
     JxlPixelFormat pixel_format = {
@@ -584,62 +5375,72 @@ static int save(ImlibImage* im)
     basic_info.xsize = im->w;
     basic_info.ysize = im->h;
     basic_info.uses_original_profile = JXL_FALSE;
-    if(im->has_alpha)
+
+    // Don't encode channels that carry no information: alpha that's opaque everywhere, or separate
+    // R, G and B when they're always equal.
+    started = timing_now(&timing);
+    const unsigned layout = scan_argb(im->data, (size_t)im->w * im->h, ARGB_GRAY | (im->has_alpha ? ARGB_OPAQUE : 0));
+    timing_end_phase(&timing, PHASE_SCAN, started);
+    const bool save_alpha = im->has_alpha && !(layout & ARGB_OPAQUE);
+    const bool save_gray = (layout & ARGB_GRAY);
+    DEBUG_PRINTF("Saving %s%s", save_gray ? "gray" : "RGB", save_alpha ? " + alpha" : "");
+
+    basic_info.num_color_channels = save_gray ? 1 : 3;
+    pixel_format.num_channels = basic_info.num_color_channels;
+    if(save_alpha)
     {
         basic_info.alpha_bits = 8;
         basic_info.num_extra_channels = 1;
-        pixel_format.num_channels = 4;
+        pixel_format.num_channels++;
     }
     else
     {
         basic_info.alpha_bits = 0;
         basic_info.num_extra_channels = 0;
     }
-    size_t num_pixels = basic_info.xsize * basic_info.ysize;
-    
-    // Check for specific quality/compression parameters
-    ImlibImageTag *tag;
 
-    if((tag = __imlib_GetTag(im, "quality")))
+    int effort = opts.effort;
+    if(opts.fast_lossless)
+    {
+        // Effort 1 lossless is libjxl's dedicated fast path, which is many times faster than the default effort
+        basic_info.uses_original_profile = JXL_TRUE;
+        if(JxlEncoderSetFrameLossless(frame_opts, JXL_TRUE) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetFrameLossless");
+        effort = 1;
+        DEBUG_PRINTF("Fast lossless encoding");
+    }
+    else if(opts.quality == 99)
     {
-        // Other loaders seem to assume that quality is in the range [0-99] (?)
-        const int max_quality = 99;
-
-        int quality = (tag->val < 0) ? 0 :
-                      (tag->val > max_quality) ? max_quality :
-                       tag->val;
-
         // If quality is maxed out, explicity enable lossless mode
-        if(quality == max_quality)
-        {
-            basic_info.uses_original_profile = JXL_TRUE;
-            if(JxlEncoderSetFrameLossless(opts, JXL_TRUE) != JXL_ENC_SUCCESS)
-                RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetFrameLossless");
-            DEBUG_PRINTF("Lossless encoding");
-        }
-        else
-        {
-            // Transform quality 0-99 to distance 15-0
-            float distance = 15 - (quality * 15/(float)max_quality);
-            if(JxlEncoderSetFrameDistance(opts, distance) != JXL_ENC_SUCCESS)
-                RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetFrameDistance: %.1f", distance);
-            DEBUG_PRINTF("Butteraugli distance = %.1f", distance);
-        }
+        basic_info.uses_original_profile = JXL_TRUE;
+        if(JxlEncoderSetFrameLossless(frame_opts, JXL_TRUE) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetFrameLossless");
+        DEBUG_PRINTF("Lossless encoding");
     }
-
-    if((tag = __imlib_GetTag(im, "compression")))
+    else if(opts.quality >= 0)
     {
-        // Other loaders seem to assume that compression is in the range [0-9] (?)
-        // libjxl works with [1-9]
+        // Transform quality 0-99 to distance 15-0
+        float distance = 15 - (opts.quality * 15/99.0f);
+        if(JxlEncoderSetFrameDistance(frame_opts, distance) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderSetFrameDistance: %.1f", distance);
+        DEBUG_PRINTF("Butteraugli distance = %.1f", distance);
+    }
 
-        int compression = (tag->val < 1) ? 1 :
-                          (tag->val > 9) ? 9 :
-                           tag->val;
+    if(effort > 0)
+    {
+        if(JxlEncoderFrameSettingsSetOption(frame_opts, JXL_ENC_FRAME_SETTING_EFFORT, effort) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderFrameSettingsSetOption(JXL_ENC_FRAME_SETTING_EFFORT, %d)", effort);
 
-        if(JxlEncoderFrameSettingsSetOption(opts, JXL_ENC_FRAME_SETTING_EFFORT, compression) != JXL_ENC_SUCCESS)
-            RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderFrameSettingsSetOption(JXL_ENC_FRAME_SETTING_EFFORT, %d)", compression);
+        DEBUG_PRINTF("Effort = %d", effort);
+    }
 
-        DEBUG_PRINTF("Effort = %d", compression);
+    for(size_t i = 0; i < NUM_FRAME_SETTING_TAGS; ++i)
+    {
+        if(opts.frame_settings[i] < 0)
+            continue;
+        if(JxlEncoderFrameSettingsSetOption(frame_opts, frame_setting_tags[i].id, opts.frame_settings[i]) != JXL_ENC_SUCCESS)
+            RETURN_ERR(LOAD_FAIL, "Failed to set %s = %d", frame_setting_tags[i].tag, opts.frame_settings[i]);
+        DEBUG_PRINTF("%s = %d", frame_setting_tags[i].tag, opts.frame_settings[i]);
     }
 
     if(JxlEncoderSetBasicInfo(enc, &basic_info) != JXL_ENC_SUCCESS)
@@ -654,11 +5455,34 @@ static int save(ImlibImage* im)
     }
 
     JxlColorEncoding color;
-    JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+    JxlColorEncodingSetToSRGB(&color, save_gray ? JXL_TRUE : JXL_FALSE);
     if(JxlEncoderSetColorEncoding(enc, &color) != JXL_ENC_SUCCESS)
         RETURN_ERR(LOAD_FAIL, "Failed in JXLEncoderSetColorEncoding");
 
-    const size_t pixels_size = pixel_format.num_channels * im->w * im->h;
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    // Let libjxl ask for the pixels a rectangle at a time, rather than converting a copy of the whole image
+    source.argb = im->data;
+    source.width = im->w;
+    source.num_channels = pixel_format.num_channels;
+    source.timing = &timing;
+
+    struct JxlChunkedFrameInputSource chunked_input = {
+                                                          .opaque = &source,
+                                                          .get_color_channels_pixel_format = chunked_get_color_pixel_format,
+                                                          .get_color_channel_data_at = chunked_get_color_data,
+                                                          .get_extra_channel_pixel_format = chunked_get_extra_pixel_format,
+                                                          .get_extra_channel_data_at = chunked_get_extra_data,
+                                                          .release_buffer = chunked_release_buffer
+                                                      };
+
+    // This is the last frame, so this also closes the input.  From here on, libjxl asks for pixels
+    // and writes output as it goes, so the copy and write times are included in the encode time.
+    started = timing_now(&timing);
+    if(JxlEncoderAddChunkedFrame(frame_opts, JXL_TRUE, chunked_input) != JXL_ENC_SUCCESS || source.failed)
+        RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderAddChunkedFrame");
+#else
+    const size_t num_pixels = basic_info.xsize * basic_info.ysize;
+    const size_t pixels_size = pixel_format.num_channels * num_pixels;
 
     // Create a copy of the pixel data with the channels in the correct order
 
@@ -666,45 +5490,48 @@ static int save(ImlibImage* im)
         RETURN_ERR(LOAD_OOM, "Failed to allocate %" PRIu32 " * %" PRIu32 " * %" PRIu32 " = %zu B", pixel_format.num_channels, im->w, im->h, pixels_size);
 
     // Data from imlib2 is 32-bit ARGB, so now have to swap the channels around for libjxl.
-    const uint32_t* impixel = im->data;
-    if(pixel_format.num_channels == 3)
-    {
-        for(size_t i=0; i<num_pixels; ++i)
-        {
-            const uint32_t pixel = *(impixel++);
-            pixels[i*3+0] = PIXEL_R(pixel);
-            pixels[i*3+1] = PIXEL_G(pixel);
-            pixels[i*3+2] = PIXEL_B(pixel);
-        }
-    }
-    else
-    {
-        for(size_t i=0; i<num_pixels; ++i)
-        {
-            const uint32_t pixel = *(impixel++);
-            pixels[i*4+0] = PIXEL_R(pixel);
-            pixels[i*4+1] = PIXEL_G(pixel);
-            pixels[i*4+2] = PIXEL_B(pixel);
-            pixels[i*4+3] = PIXEL_A(pixel);
-        }
-    }
+    started = timing_now(&timing);
+    swizzle_from_argb(pixels, im->data, num_pixels, pixel_format.num_channels);
+    timing_end_phase(&timing, PHASE_COPY, started);
 
-    // Tell encoder to use these pixels
-    if(JxlEncoderAddImageFrame(opts, &pixel_format, pixels, pixels_size) != JXL_ENC_SUCCESS)
+    // Tell encoder to use these pixels.  The encode time excludes the writes.
+    started = timing_now(&timing);
+    if(JxlEncoderAddImageFrame(frame_opts, &pixel_format, pixels, pixels_size) != JXL_ENC_SUCCESS)
         RETURN_ERR(LOAD_FAIL, "Failed in JxlEncoderAddImageFrame");
 
     // Tell encoder there are no more frames after this one
     JxlEncoderCloseInput(enc);
+#endif
 
-    FILE* const out = im->fi->fp;
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    // Finish encoding; everything has been written once this returns
+    if(JxlEncoderFlushInput(enc) != JXL_ENC_SUCCESS)
+        RETURN_ERR(LOAD_FAIL, "Error during encoding");
+    timing_end_phase(&timing, PHASE_ENCODE, started);
+    timing.bytes = stream.end;
+    if(stream.failed)
+        RETURN_ERR(LOAD_FAIL, "Failed to write the encoded image");
 
+    // Leave the file positioned after the image, as fwrite would have
+    if(stream.seekable && lseek(stream.fd, stream.base + stream.end, SEEK_SET) == -1)
+        RETURN_ERR(LOAD_FAIL, "Failed to seek to the end of the output");
+#else
     // Create buffer for encoded bytes - it doesn't matter if it's too small (within reason)
     size_t jxl_bytes_size = pixels_size / 16;
     if(jxl_bytes_size < 8*1024)
         jxl_bytes_size = 8*1024;
 
-    if(!(jxl_bytes = malloc(jxl_bytes_size)))
+    // Use the buffer from the last save if it's big enough
+    if(pe->buffer && pe->buffer_size >= jxl_bytes_size)
+    {
+        jxl_bytes = pe->buffer;
+        jxl_bytes_size = pe->buffer_size;
+        pe->buffer = NULL;
+    }
+    else if(!(jxl_bytes = malloc(jxl_bytes_size)))
+    {
         RETURN_ERR(LOAD_OOM, "Failed to allocate %zu B", jxl_bytes_size);
+    }
 
     JxlEncoderStatus res;
     uint8_t *next_out = jxl_bytes;
@@ -718,12 +5545,16 @@ static int save(ImlibImage* im)
                 RETURN_ERR(LOAD_FAIL, "Encoding stalled");
 
             // Flush what we've got to clear the output buffer and continue
-
+            timing_end_phase(&timing, PHASE_ENCODE, started);
+            started = timing_now(&timing);
             if(fwrite(jxl_bytes, 1, jxl_bytes_size - avail_out, out) != jxl_bytes_size-avail_out)
                 RETURN_ERR(LOAD_FAIL, "Failed to write %zu B", jxl_bytes_size - avail_out);
+            timing_end_phase(&timing, PHASE_WRITE, started);
+            timing.bytes += jxl_bytes_size - avail_out;
 
             next_out = jxl_bytes;
             avail_out = jxl_bytes_size;
+            started = timing_now(&timing);
         }
         else
         {
@@ -731,21 +5562,33 @@ static int save(ImlibImage* im)
         }
     }
 
+    timing_end_phase(&timing, PHASE_ENCODE, started);
+
+    started = timing_now(&timing);
     if(fwrite(jxl_bytes, 1, jxl_bytes_size - avail_out, out) != jxl_bytes_size-avail_out)
         RETURN_ERR(LOAD_FAIL, "Failed to write %zu B", jxl_bytes_size - avail_out);
-    
+    timing_end_phase(&timing, PHASE_WRITE, started);
+    timing.bytes += jxl_bytes_size - avail_out;
+#endif
 
     retval = LOAD_SUCCESS;
 
 ret:
+    if(pe)
+        mem_report(&pe->memory, "save");
+    timing_report(&timing, "save", TIMING_SAVE_PHASES, retval,
+                  pe ? atomic_load_explicit(&pe->memory.peak, memory_order_relaxed) : 0, im->fi->name);
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0,10,0)
+    chunked_source_free(&source);
+    encoder_release(pe, stream.buffer, stream.buffer_size);
+#else
     free(pixels);
-    free(jxl_bytes);
-    if(enc)
-        JxlEncoderDestroy(enc);
-    if(runner)
-        JxlThreadParallelRunnerDestroy(runner);
+    encoder_release(pe, jxl_bytes, jxl_bytes ? jxl_bytes_size : 0);
+#endif
+    runner_release(runner);
     return retval;
 }
 
 
 IMLIB_LOADER(formats, load, save);
+#endif // IMLIB2JXL_POOL_ONLY
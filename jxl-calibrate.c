@@ -0,0 +1,497 @@
+/*
+ * Calibration benchmark for the imlib2 JPEG XL loader's thread use.
+ *
+ * libjxl splits images into 256x256 groups and hands them out to threads.  For small images,
+ * the cost of sharing the work is more than the time saved, so the loader gives each thread at
+ * least IMLIB2_JXL_GROUPS_PER_THREAD groups.  This program encodes synthetic images of increasing
+ * size, times decoding each with one thread and with more, and prints the setting that suits
+ * this machine.  Any JPEG XL files named on the command line are timed and reported as well.
+ *
+ * With --encode, it instead measures saving throughput: it encodes a large synthetic image and the
+ * pixels of any files named, losslessly with the fast lossless mode (effort 1) and at libjxl's
+ * default effort, and prints megapixels per second for each.
+ *
+ * The decodes and encodes run on the loader's own thread pool and runner, built from imlib2-jxl.c,
+ * so the times include the same overheads as the loader's.  IMLIB2_JXL_THREADS is respected.
+ *
+ * Build with `make calibrate`, then run ./jxl-calibrate [--encode] [file.jxl ...]
+ */
+
+// Just the loader's shared worker threads
+#define IMLIB2JXL_POOL_ONLY
+#include "imlib2-jxl.c"
+
+/**
+ * Number of times each decode is repeated.  The fastest time is used.
+ */
+#define REPEATS 5
+
+/**
+ * How much faster two threads must be than one for the extra thread to count as worthwhile.
+ */
+#define SPEEDUP_THRESHOLD 0.9
+
+/**
+ * Size of the synthetic image that encoding throughput is measured with.
+ */
+#define ENCODE_SIZE 4096
+
+/**
+ * Synthetic image sizes, in increasing number of groups.
+ */
+static const struct { size_t w, h; } sizes[] = {
+    {  256,  256 }, {  512,  256 }, {  768,  256 }, {  512,  512 }, {  768,  512 }, { 1024,  512 },
+    {  768,  768 }, { 1024,  768 }, { 1024, 1024 }, { 1536, 1024 }, { 1536, 1536 }, { 2048, 2048 }
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t count_groups(size_t w, size_t h)
+{
+    return ((w + GROUP_DIM - 1) / GROUP_DIM) * ((h + GROUP_DIM - 1) / GROUP_DIM);
+}
+
+/**
+ * @brief Make an RGB image of smooth gradients with some noise, so it's neither trivial nor pure noise.
+ *
+ * @return Allocated pixels, or @c NULL on failure.
+ */
+static uint8_t *make_image(size_t w, size_t h)
+{
+    uint8_t *pixels;
+    if(!(pixels = malloc(w * h * 3)))
+        return NULL;
+
+    uint32_t seed = 12345;
+    for(size_t y = 0; y < h; ++y)
+    {
+        for(size_t x = 0; x < w; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            const int noise = (seed >> 16) % 16;
+            uint8_t *p = pixels + (y * w + x) * 3;
+            p[0] = (x * 255 / w + noise) & 0xFF;
+            p[1] = (y * 255 / h + noise) & 0xFF;
+            p[2] = ((x + y) * 127 / (w + h) + noise) & 0xFF;
+        }
+    }
+    return pixels;
+}
+
+/**
+ * @brief Encode 8-bit RGB or RGBA pixels as a JPEG XL file.
+ *
+ * @param[in] num_channels 3 for RGB, or 4 for RGBA.
+ * @param[in] effort libjxl encoding effort, or 0 for libjxl's default.
+ * @param[in] lossless Whether to encode losslessly, rather than at libjxl's default distance.
+ * @param[in] runner Runner from runner_acquire(), or @c NULL to encode on the calling thread.
+ *
+ * @return 0 on success.
+ */
+static int encode(const uint8_t *pixels, size_t w, size_t h, int num_channels, int effort, bool lossless,
+                  void *runner, uint8_t **out, size_t *out_size)
+{
+    int retval = -1;
+    JxlEncoder *enc = NULL;
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 64 * 1024;
+
+    JxlPixelFormat pixel_format = { .num_channels = num_channels, .data_type = JXL_TYPE_UINT8,
+                                    .endianness = JXL_NATIVE_ENDIAN, .align = 0 };
+    JxlBasicInfo basic_info;
+    JxlColorEncoding color;
+    JxlEncoderFrameSettings *opts;
+
+    if(!(enc = JxlEncoderCreate(NULL)))
+        goto ret;
+    if(runner && JxlEncoderSetParallelRunner(enc, pool_run, runner) != JXL_ENC_SUCCESS)
+        goto ret;
+    JxlEncoderInitBasicInfo(&basic_info);
+    basic_info.xsize = w;
+    basic_info.ysize = h;
+    basic_info.uses_original_profile = lossless ? JXL_TRUE : JXL_FALSE;
+    if(num_channels == 4)
+    {
+        basic_info.alpha_bits = 8;
+        basic_info.num_extra_channels = 1;
+    }
+    JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+    if(JxlEncoderSetBasicInfo(enc, &basic_info) != JXL_ENC_SUCCESS ||
+       JxlEncoderSetColorEncoding(enc, &color) != JXL_ENC_SUCCESS ||
+       !(opts = JxlEncoderFrameSettingsCreate(enc, NULL)) ||
+       (lossless && JxlEncoderSetFrameLossless(opts, JXL_TRUE) != JXL_ENC_SUCCESS) ||
+       (effort > 0 && JxlEncoderFrameSettingsSetOption(opts, JXL_ENC_FRAME_SETTING_EFFORT, effort) != JXL_ENC_SUCCESS) ||
+       JxlEncoderAddImageFrame(opts, &pixel_format, pixels, w * h * num_channels) != JXL_ENC_SUCCESS)
+        goto ret;
+    JxlEncoderCloseInput(enc);
+
+    if(!(buffer = malloc(buffer_size)))
+        goto ret;
+    uint8_t *next_out = buffer;
+    size_t avail_out = buffer_size;
+    JxlEncoderStatus res;
+    while((res = JxlEncoderProcessOutput(enc, &next_out, &avail_out)) == JXL_ENC_NEED_MORE_OUTPUT)
+    {
+        const size_t used = next_out - buffer;
+        uint8_t *bigger;
+        if(!(bigger = realloc(buffer, buffer_size * 2)))
+            goto ret;
+        buffer = bigger;
+        buffer_size *= 2;
+        next_out = buffer + used;
+        avail_out = buffer_size - used;
+    }
+    if(res != JXL_ENC_SUCCESS)
+        goto ret;
+
+    *out = buffer;
+    *out_size = next_out - buffer;
+    buffer = NULL;
+    retval = 0;
+
+ret:
+    free(buffer);
+    if(enc)
+        JxlEncoderDestroy(enc);
+    return retval;
+}
+
+/**
+ * @brief Time decoding a JPEG XL file to 8-bit RGBA.
+ *
+ * @param[in] threads Number of threads, counting the calling thread, or -1 for the loader's whole budget.
+ * @param[out] w,h Receive the image dimensions.
+ *
+ * @return The fastest of REPEATS decodes in seconds, or a negative number on failure.
+ */
+static double time_decode(const uint8_t *data, size_t size, int threads, size_t *w, size_t *h)
+{
+    double best = -1;
+    uint8_t *pixels = NULL;
+    JxlPixelFormat pixel_format = { .num_channels = 4, .data_type = JXL_TYPE_UINT8,
+                                    .endianness = JXL_NATIVE_ENDIAN, .align = 0 };
+
+    for(int i = 0; i < REPEATS; ++i)
+    {
+        JxlDecoder *dec;
+        void *runner;
+        if(!(dec = JxlDecoderCreate(NULL)))
+            break;
+        if(!(runner = runner_acquire(threads)))
+        {
+            JxlDecoderDestroy(dec);
+            break;
+        }
+
+        const double start = now();
+        bool ok = JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) == JXL_DEC_SUCCESS &&
+                  JxlDecoderSetParallelRunner(dec, pool_run, runner) == JXL_DEC_SUCCESS &&
+                  JxlDecoderSetInput(dec, data, size) == JXL_DEC_SUCCESS;
+        JxlDecoderCloseInput(dec);
+
+        JxlDecoderStatus res = JXL_DEC_ERROR;
+        while(ok && (res = JxlDecoderProcessInput(dec)) != JXL_DEC_SUCCESS)
+        {
+            if(res == JXL_DEC_BASIC_INFO)
+            {
+                JxlBasicInfo basic_info;
+                ok = JxlDecoderGetBasicInfo(dec, &basic_info) == JXL_DEC_SUCCESS;
+                *w = basic_info.xsize;
+                *h = basic_info.ysize;
+                // As the loader does; main() sets one group per thread, so this only stops more threads
+                // being asked for than there are groups
+                runner_fit_image(runner, *w, *h);
+            }
+            else if(res == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
+            {
+                const size_t pixels_size = *w * *h * 4;
+                if(!pixels && !(pixels = malloc(pixels_size)))
+                    ok = false;
+                else
+                    ok = JxlDecoderSetImageOutBuffer(dec, &pixel_format, pixels, pixels_size) == JXL_DEC_SUCCESS;
+            }
+            else if(res != JXL_DEC_FULL_IMAGE)
+            {
+                ok = false;
+            }
+        }
+        const double elapsed = now() - start;
+        JxlDecoderDestroy(dec);
+        runner_release(runner);
+
+        if(!ok)
+        {
+            best = -1;
+            break;
+        }
+        if(best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    free(pixels);
+    return best;
+}
+
+/**
+ * @brief Time a file with one, two and all threads, and print a line of results.
+ *
+ * @return Whether two threads were worthwhile, or -1 on failure.
+ */
+static int report(const char *name, const uint8_t *data, size_t size)
+{
+    size_t w = 0, h = 0;
+    const double t1 = time_decode(data, size, 1, &w, &h);
+    const double t2 = time_decode(data, size, 2, &w, &h);
+    const double tn = time_decode(data, size, -1, &w, &h);
+    if(t1 < 0 || t2 < 0 || tn < 0)
+    {
+        fprintf(stderr, "%s: failed to decode\n", name);
+        return -1;
+    }
+
+    printf("%-24s %5zux%-5zu %6zu %10.2f %10.2f %10.2f\n", name, w, h, count_groups(w, h), t1 * 1e3, t2 * 1e3, tn * 1e3);
+    return t2 < t1 * SPEEDUP_THRESHOLD;
+}
+
+static uint8_t *read_file(const char *name, size_t *size)
+{
+    FILE *f;
+    uint8_t *data = NULL;
+    long length;
+
+    if(!(f = fopen(name, "rb")))
+        return NULL;
+    if(fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0 &&
+       (data = malloc(length)) && fread(data, 1, length, f) == (size_t)length)
+    {
+        *size = length;
+    }
+    else
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/**
+ * @brief Decode a JPEG XL file to 8-bit RGB, or RGBA if it has alpha.
+ *
+ * @return Allocated pixels, or @c NULL on failure.
+ */
+static uint8_t *decode_pixels(const uint8_t *data, size_t size, size_t *w, size_t *h, int *num_channels)
+{
+    uint8_t *pixels = NULL;
+    JxlDecoder *dec;
+    JxlPixelFormat pixel_format = { .num_channels = 3, .data_type = JXL_TYPE_UINT8,
+                                    .endianness = JXL_NATIVE_ENDIAN, .align = 0 };
+
+    if(!(dec = JxlDecoderCreate(NULL)))
+        return NULL;
+    bool ok = JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) == JXL_DEC_SUCCESS &&
+              JxlDecoderSetInput(dec, data, size) == JXL_DEC_SUCCESS;
+    JxlDecoderCloseInput(dec);
+
+    JxlDecoderStatus res = JXL_DEC_ERROR;
+    while(ok && (res = JxlDecoderProcessInput(dec)) != JXL_DEC_FULL_IMAGE)
+    {
+        if(res == JXL_DEC_BASIC_INFO)
+        {
+            JxlBasicInfo basic_info;
+            ok = JxlDecoderGetBasicInfo(dec, &basic_info) == JXL_DEC_SUCCESS;
+            *w = basic_info.xsize;
+            *h = basic_info.ysize;
+            pixel_format.num_channels = *num_channels = (basic_info.alpha_bits > 0) ? 4 : 3;
+        }
+        else if(res == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
+        {
+            const size_t pixels_size = *w * *h * pixel_format.num_channels;
+            ok = (pixels = malloc(pixels_size)) &&
+                 JxlDecoderSetImageOutBuffer(dec, &pixel_format, pixels, pixels_size) == JXL_DEC_SUCCESS;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    JxlDecoderDestroy(dec);
+
+    if(!ok)
+    {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+/**
+ * @brief Time encoding pixels losslessly.
+ *
+ * @param[in] effort libjxl encoding effort, or 0 for libjxl's default.
+ * @param[out] out_size Receives the size of the encoded file.
+ *
+ * @return The fastest of REPEATS encodes in seconds, or a negative number on failure.
+ */
+static double time_encode(const uint8_t *pixels, size_t w, size_t h, int num_channels, int effort, size_t *out_size)
+{
+    double best = -1;
+
+    for(int i = 0; i < REPEATS; ++i)
+    {
+        void *runner;
+        uint8_t *jxl;
+        if(!(runner = runner_acquire(-1)))
+            return -1;
+        runner_fit_image(runner, w, h);
+
+        const double start = now();
+        const int rc = encode(pixels, w, h, num_channels, effort, true, runner, &jxl, out_size);
+        const double elapsed = now() - start;
+        runner_release(runner);
+        if(rc)
+            return -1;
+        free(jxl);
+
+        if(best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/**
+ * @brief Time encoding pixels with the fast lossless mode and at the default effort, and print a line of results.
+ *
+ * @return 0 on success.
+ */
+static int report_encode(const char *name, const uint8_t *pixels, size_t w, size_t h, int num_channels)
+{
+    size_t fast_size, default_size;
+    const double fast = time_encode(pixels, w, h, num_channels, 1, &fast_size);
+    const double slow = time_encode(pixels, w, h, num_channels, 0, &default_size);
+    if(fast < 0 || slow < 0)
+    {
+        fprintf(stderr, "%s: failed to encode\n", name);
+        return -1;
+    }
+
+    const double megapixels = (double)w * h / 1e6;
+    printf("%-24s %5zux%-5zu %12.1f %10zu %12.1f %10zu\n", name, w, h,
+           megapixels / fast, fast_size, megapixels / slow, default_size);
+    return 0;
+}
+
+/**
+ * @brief Measure saving throughput, for --encode.
+ *
+ * @return Exit status.
+ */
+static int measure_encode(int argc, char **argv)
+{
+    const uint32_t version = JxlEncoderVersion();
+    printf("libjxl %u.%u.%u, lossless encoding\n", version / 1000000, version / 1000 % 1000, version % 1000);
+    printf("%-24s %11s %12s %10s %12s %10s\n", "image", "size", "fast (MP/s)", "bytes", "default (MP/s)", "bytes");
+    printf("(%u threads; each speed is from the fastest of %d)\n", thread_pool.budget + 1, REPEATS);
+
+    uint8_t *pixels;
+    if(!(pixels = make_image(ENCODE_SIZE, ENCODE_SIZE)))
+    {
+        fprintf(stderr, "Failed to make a %dx%d test image\n", ENCODE_SIZE, ENCODE_SIZE);
+        return 1;
+    }
+    const int rc = report_encode("synthetic", pixels, ENCODE_SIZE, ENCODE_SIZE, 3);
+    free(pixels);
+    if(rc)
+        return 1;
+
+    for(int i = 0; i < argc; ++i)
+    {
+        uint8_t *data;
+        size_t size, w = 0, h = 0;
+        int num_channels = 3;
+        if(!(data = read_file(argv[i], &size)))
+        {
+            fprintf(stderr, "%s: failed to read\n", argv[i]);
+            continue;
+        }
+        pixels = decode_pixels(data, size, &w, &h, &num_channels);
+        free(data);
+        if(!pixels)
+        {
+            fprintf(stderr, "%s: failed to decode\n", argv[i]);
+            continue;
+        }
+        report_encode(argv[i], pixels, w, h, num_channels);
+        free(pixels);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t threshold_groups = 0;
+
+    // Measure without the loader's own limit on threads for small images, which is what's being calibrated
+    setenv("IMLIB2_JXL_GROUPS_PER_THREAD", "1", 1);
+    pthread_once(&thread_pool.once, thread_pool_init);
+
+    if(argc > 1 && strcmp(argv[1], "--encode") == 0)
+        return measure_encode(argc - 2, argv + 2);
+
+    printf("%-24s %11s %6s %10s %10s %10s\n", "image", "size", "groups", "1 thr (ms)", "2 thr (ms)", "all (ms)");
+    printf("(all = %u threads; each time is the fastest of %d)\n", thread_pool.budget + 1, REPEATS);
+
+    for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+    {
+        uint8_t *pixels, *jxl = NULL;
+        size_t jxl_size;
+
+        if(!(pixels = make_image(sizes[i].w, sizes[i].h)) ||
+           encode(pixels, sizes[i].w, sizes[i].h, 3, 3, false, NULL, &jxl, &jxl_size))
+        {
+            fprintf(stderr, "Failed to make a %zux%zu test image\n", sizes[i].w, sizes[i].h);
+            free(pixels);
+            return 1;
+        }
+        free(pixels);
+
+        const int worthwhile = report("synthetic", jxl, jxl_size);
+        free(jxl);
+        if(worthwhile < 0)
+            return 1;
+        if(worthwhile && threshold_groups == 0)
+            threshold_groups = count_groups(sizes[i].w, sizes[i].h);
+    }
+
+    for(int i = 1; i < argc; ++i)
+    {
+        uint8_t *data;
+        size_t size;
+        if(!(data = read_file(argv[i], &size)))
+        {
+            fprintf(stderr, "%s: failed to read\n", argv[i]);
+            continue;
+        }
+        report(argv[i], data, size);
+        free(data);
+    }
+
+    if(threshold_groups == 0)
+    {
+        const size_t largest = sizeof(sizes)/sizeof(sizes[0]) - 1;
+        threshold_groups = count_groups(sizes[largest].w, sizes[largest].h);
+        printf("\nA second thread didn't help with any of the synthetic images.\n");
+    }
+
+    // The loader gives an image of G groups G / IMLIB2_JXL_GROUPS_PER_THREAD threads, rounding down.  For the
+    // smallest image that two threads decoded usefully faster to get two, the setting can be at most half its
+    // groups; the largest such setting keeps the images smaller than it on as few threads as possible.
+    const size_t groups_per_thread = threshold_groups / 2;
+    printf("\nIMLIB2_JXL_GROUPS_PER_THREAD=%zu\n", (groups_per_thread > 0) ? groups_per_thread : 1);
+    return 0;
+}